@@ -36,10 +36,274 @@
 
 #include <numeric>
 #include <optional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <variant>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <climits>
+#include <cmath>
+#include <vector>
+#include <array>
+#include <string>
+#include <algorithm>
+#include <utility>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <type_traits>
 
+// memory mapped files, for loading scene files (see MappedFile)
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#endif
+
+// when compiled with AVX2 or AVX-512 enabled, the BVH intersects rays with 8 or 16 Spheres at a time
+// (define RT_NO_SIMD to force the scalar code path)
+#if !defined(RT_NO_SIMD) && (defined(__AVX512F__) || defined(__AVX2__))
+#define RT_SIMD
+#include <immintrin.h>
+#endif
+
+// define RT_FAST_MATH for approximate versions of the math helpers that run several times per ray: normalize() from
+// a reciprocal square root estimate, the checkerboard of Planes from floor() instead of fmod(), and a lerp() without
+// branches (see FastRsqrt(), CheckerSpanFast() and ValidateFastMath() for how close they are)
+#ifdef __SSE__
+#include <immintrin.h>
+#endif
+
+// the GPU backend uses OpenCL when RT_OPENCL is defined (see GpuBackend)
+#ifdef RT_OPENCL
+#define CL_TARGET_OPENCL_VERSION 120
+#include <CL/cl.h>
+#endif
+
+// define RT_HEADLESS to build the command line renderer instead of the viewer - it doesn't need olc::PixelGameEngine
+#ifndef RT_HEADLESS
 #define OLC_PGE_APPLICATION
 #include "olcPixelGameEngine.h"
+#endif
+
+// instrumentation of the hot paths - all of it compiles to nothing unless it is enabled:
+//   RT_INSTRUMENT  counts fog early-outs, misses, reflections per bounce level and occluded shadow rays per thread,
+//                  and measures the time spent in intersection queries (RT_COUNT, RT_TIME)
+//   RT_TRACE       records scoped trace zones (RT_ZONE) per thread, which are written in the Chrome trace event format
+//                  (for chrome://tracing or ui.perfetto.dev)
+//   TRACY_ENABLE   maps the trace zones to Tracy zones instead (this needs the Tracy client to be on the include path)
+#define RT_CONCAT_INNER( a, b ) a##b
+#define RT_CONCAT( a, b ) RT_CONCAT_INNER( a, b )
+
+#ifdef RT_INSTRUMENT
+
+// bounces beyond this level are counted in the last one
+constexpr int TRACKED_BOUNCES = 8;
+
+struct HotPathCounters {
+    uint64_t misses          = 0;   // rays that didn't hit a Shape
+    uint64_t fog_early_outs  = 0;   // rays that hit a Shape beyond the fog distance, so the Shape wasn't shaded (with
+                                    // FOG_CULLING those aren't found, and count as misses)
+    uint64_t shadow_rays     = 0;
+    uint64_t shadow_occluded = 0;
+    uint64_t shadow_cache_hits = 0; // shadow rays against the static Shapes that were answered by the shadow cache
+    uint64_t reflections[TRACKED_BOUNCES] = {};   // reflection rays spawned at each bounce level (0 = at the primary hit)
+    uint64_t paths_terminated = 0;  // reflection rays that weren't traced because of their low weight (see PATH_TERMINATION)
+    uint64_t intersection_ns = 0;   // time spent in the intersection queries of the BVH
+    uint64_t tile_ns         = 0;   // time spent rendering tiles (intersection + shading)
+
+    HotPathCounters &operator+= ( const HotPathCounters &other ) {
+        misses          += other.misses;
+        fog_early_outs  += other.fog_early_outs;
+        shadow_rays     += other.shadow_rays;
+        shadow_occluded += other.shadow_occluded;
+        shadow_cache_hits += other.shadow_cache_hits;
+        for (int i = 0; i < TRACKED_BOUNCES; i++)
+            reflections[i] += other.reflections[i];
+        paths_terminated += other.paths_terminated;
+        intersection_ns += other.intersection_ns;
+        tile_ns         += other.tile_ns;
+        return *this;
+    }
+    HotPathCounters operator- ( const HotPathCounters &other ) const {
+        HotPathCounters result = *this;
+        result.misses          -= other.misses;
+        result.fog_early_outs  -= other.fog_early_outs;
+        result.shadow_rays     -= other.shadow_rays;
+        result.shadow_occluded -= other.shadow_occluded;
+        result.shadow_cache_hits -= other.shadow_cache_hits;
+        for (int i = 0; i < TRACKED_BOUNCES; i++)
+            result.reflections[i] -= other.reflections[i];
+        result.paths_terminated -= other.paths_terminated;
+        result.intersection_ns -= other.intersection_ns;
+        result.tile_ns         -= other.tile_ns;
+        return result;
+    }
+
+    // write the counters as a JSON object
+    void Print( FILE *file ) const {
+        fprintf( file, "{ \"misses\": %llu, \"fog_early_outs\": %llu, \"shadow_rays\": %llu, \"shadow_occluded\": %llu, \"shadow_cache_hits\": %llu, \"reflections_per_bounce\": [",
+                 (unsigned long long)misses, (unsigned long long)fog_early_outs, (unsigned long long)shadow_rays,
+                 (unsigned long long)shadow_occluded, (unsigned long long)shadow_cache_hits );
+        for (int i = 0; i < TRACKED_BOUNCES; i++)
+            fprintf( file, "%s%llu", i ? ", " : " ", (unsigned long long)reflections[i] );
+        fprintf( file, " ], \"paths_terminated\": %llu, \"intersection_ms\": %.3f, \"shading_ms\": %.3f }",
+                 (unsigned long long)paths_terminated, intersection_ns / 1e6, (tile_ns > intersection_ns ? tile_ns - intersection_ns : 0) / 1e6 );
+    }
+};
+
+// the counters of the calling thread
+inline HotPathCounters &ThreadHotPathCounters() {
+    static thread_local HotPathCounters counters;
+    return counters;
+}
+
+// adds the time between its construction and destruction to a counter (in nanoseconds)
+struct ScopedTimer {
+    uint64_t &target;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    ~ScopedTimer() {
+        target += std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+    }
+};
+
+#define RT_COUNT( counter ) (void)(ThreadHotPathCounters().counter++)
+#define RT_TIME( counter )  ScopedTimer RT_CONCAT( scoped_timer_, __LINE__ ){ ThreadHotPathCounters().counter }
+#else
+#define RT_COUNT( counter ) ((void)0)
+#define RT_TIME( counter )
+#endif // RT_INSTRUMENT
+
+#if defined(RT_TRACE)
+
+// collects the trace zones of all threads - every thread records into its own buffer, so recording needs no locking
+class TraceRecorder {
+public:
+    // zones beyond this number per thread are dropped, to bound the memory use (and the size of the trace)
+    static constexpr size_t MAX_EVENTS_PER_THREAD = size_t( 1 ) << 20;
+
+    struct event {
+        const char *name;
+        int64_t     start_ns, duration_ns;
+    };
+
+    static void Record( const char *name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end ) {
+        thread_buffer &buffer = ThreadBuffer();
+        if (buffer.events.size() >= MAX_EVENTS_PER_THREAD) {
+            buffer.dropped++;
+            return;
+        }
+        buffer.events.push_back( { name, Nanoseconds( start ), Nanoseconds( end ) - Nanoseconds( start ) } );
+    }
+
+    // write all zones recorded so far as Chrome trace events - returns false if the file can't be written
+    static bool Write( const std::string &path ) {
+        FILE *file = fopen( path.c_str(), "w" );
+        if (file == nullptr)
+            return false;
+        std::lock_guard<std::mutex> lock( Registry().mtx );
+        fprintf( file, "{\"traceEvents\":[\n" );
+        const char *separator = "";
+        uint64_t dropped = 0;
+        for (size_t tid = 0; tid < Registry().buffers.size(); tid++) {
+            const thread_buffer &buffer = *Registry().buffers[tid];
+            for (const event &e : buffer.events) {
+                fprintf( file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+                         separator, e.name, tid, e.start_ns / 1000.0, e.duration_ns / 1000.0 );
+                separator = ",\n";
+            }
+            dropped += buffer.dropped;
+        }
+        fprintf( file, "\n],\"otherData\":{\"dropped_events\":%llu}}\n", (unsigned long long)dropped );
+        return fclose( file ) == 0;
+    }
+
+private:
+    struct thread_buffer {
+        std::vector<event> events;
+        uint64_t           dropped = 0;
+    };
+    // the buffers are owned by the registry, so they outlive the threads that recorded them
+    struct registry {
+        std::mutex                                  mtx;
+        std::vector<std::unique_ptr<thread_buffer>> buffers;
+        std::chrono::steady_clock::time_point       epoch = std::chrono::steady_clock::now();
+    };
+    static registry &Registry() {
+        static registry instance;
+        return instance;
+    }
+    static thread_buffer &ThreadBuffer() {
+        static thread_local thread_buffer *buffer = [] {
+            std::lock_guard<std::mutex> lock( Registry().mtx );
+            Registry().buffers.push_back( std::make_unique<thread_buffer>());
+            return Registry().buffers.back().get();
+        }();
+        return *buffer;
+    }
+    static int64_t Nanoseconds( std::chrono::steady_clock::time_point t ) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>( t - Registry().epoch ).count();
+    }
+};
+
+// records the time between its construction and destruction as a zone with the given name
+struct TraceZone {
+    const char *name;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    ~TraceZone() {
+        TraceRecorder::Record( name, start, std::chrono::steady_clock::now());
+    }
+};
+
+#define RT_ZONE( name ) TraceZone RT_CONCAT( trace_zone_, __LINE__ ){ name }
+#elif defined(TRACY_ENABLE)
+#include <tracy/Tracy.hpp>
+#define RT_ZONE( name ) ZoneScopedN( name )
+#else
+#define RT_ZONE( name )
+#endif // RT_TRACE
+
+
+// 1 / sqrt( x ), from the estimate of the CPU (12 bits) refined by a Newton-Raphson step to about 23 bits - without
+// SSE it's the exact one
+inline float FastRsqrt( float x ) {
+#ifdef __SSE__
+    float y = _mm_cvtss_f32( _mm_rsqrt_ss( _mm_set_ss( x )));
+    return y * (1.5f - 0.5f * x * y * y);
+#else
+    return 1.0f / sqrtf( x );
+#endif
+}
 
+// whether d lies in the first half of its 100-unit span of the checkerboard, i.e. fmod( fabs( d ), 100 ) < 50
+inline bool CheckerSpanExact( float d ) {
+    return fmod( fabs( d ), 100 ) < 50;
+}
+// the same from the parity of the number of 50-unit half spans (a float that is a whole number is even if its half
+// is one too) - it may differ from CheckerSpanExact() right at the edges of the checkers, where the rounding of the
+// division differs from that of fmod()
+inline bool CheckerSpanFast( float d ) {
+    float half_spans = floorf( fabs( d ) * (1.0f / 50.0f));
+    return floorf( half_spans * 0.5f ) == half_spans * 0.5f;
+}
 
 // struct to describe a 3D floating point vector
 struct vf3d {
@@ -73,7 +337,11 @@ struct vf3d {
     }
     // return a normalized version of this vf3d (length == 1)
     const vf3d normalize() const {
+#ifdef RT_FAST_MATH
+        return (*this) * FastRsqrt( (*this) * (*this) );
+#else
         return (*this) / length();
+#endif
     }
     // returns the length / magnitude of this vf3d
     const float length() const {
@@ -106,6 +374,67 @@ struct ray {
     }
 };
 
+// struct to describe an axis aligned bounding box
+struct aabb {
+    // an empty box has min > max, so that growing it with anything results in that thing
+    vf3d min = vf3d(  INFINITY );
+    vf3d max = vf3d( -INFINITY );
+
+    // default constructor (empty box)
+    aabb() = default;
+    // explicit constructor that initializes min and max
+    constexpr aabb( const vf3d _min, const vf3d _max ) : min( _min ), max( _max ) {}
+
+    // grow this box so that it also encloses the given box
+    void grow( const aabb &other ) {
+        min = { std::min( min.x, other.min.x ), std::min( min.y, other.min.y ), std::min( min.z, other.min.z ) };
+        max = { std::max( max.x, other.max.x ), std::max( max.y, other.max.y ), std::max( max.z, other.max.z ) };
+    }
+    // grow this box so that it also encloses the given point
+    void grow( const vf3d &point ) {
+        grow( aabb( point, point ));
+    }
+    // returns the center point of this box
+    const vf3d centroid() const {
+        return (min + max) * 0.5f;
+    }
+    // returns true if this box and the other one have any point in common
+    bool overlaps( const aabb &other ) const {
+        return min.x <= other.max.x && other.min.x <= max.x &&
+               min.y <= other.max.y && other.min.y <= max.y &&
+               min.z <= other.max.z && other.min.z <= max.z;
+    }
+    // returns the surface area of this box (or 0 if it's empty)
+    float area() const {
+        vf3d e = max - min;
+        if (e.x < 0.0f || e.y < 0.0f || e.z < 0.0f)
+            return 0.0f;
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+    // returns the distance along ray r where it enters this box, or INFINITY if it misses the box within [0, t_max)
+    // inv_direction is the component wise reciprocal of r.direction, so it can be computed once per ray
+    float intersection( const ray &r, const vf3d &inv_direction, float t_max ) const {
+        float tx1 = (min.x - r.origin.x) * inv_direction.x, tx2 = (max.x - r.origin.x) * inv_direction.x;
+        float ty1 = (min.y - r.origin.y) * inv_direction.y, ty2 = (max.y - r.origin.y) * inv_direction.y;
+        float tz1 = (min.z - r.origin.z) * inv_direction.z, tz2 = (max.z - r.origin.z) * inv_direction.z;
+        float t_enter = std::max( std::max( std::min( tx1, tx2 ), std::min( ty1, ty2 )), std::max( std::min( tz1, tz2 ), 0.0f ));
+        float t_exit  = std::min( std::min( std::max( tx1, tx2 ), std::max( ty1, ty2 )), std::min( std::max( tz1, tz2 ), t_max ));
+        return t_enter <= t_exit ? t_enter : INFINITY;
+    }
+};
+
+// struct to describe where a ray intersects a Shape
+// The intersection query fills in t and shape_id; the rest is completed (once) by Shape::surface()
+// when the hit is shaded, so that sample() and the lighting don't have to redo any geometry work.
+struct hit_record {
+    float t = INFINITY;     // distance along the ray
+    int   shape_id = -1;    // index of the intersected Shape in the scene
+    vf3d  point;            // the intersection point
+    vf3d  normal;           // surface normal at the intersection point
+    float u = 0.0f;         // surface coordinates at the intersection point
+    float v = 0.0f;
+};
+
 // generic shape class
 class Shape {
 public:
@@ -121,18 +450,27 @@ public:
     // add explicit constructor that initializes origin and fill
     Shape( vf3d _origin, color3 _fill, float _reflectivity = 0.0f ) : origin( _origin ), fill( _fill ), reflectivity( _reflectivity ) {}
 
-    // get the color of this Shape (when intersecting with a given ray)
-    virtual color3 sample( ray sample_ray ) const { return fill; }
+    // get the color of this Shape at a given (completed) hit
+    virtual color3 sample( const hit_record & ) const { return fill; }
 
     // determine how far along a given ray this Shape intersects (if at all)
     virtual std::optional<float> intersection( ray r ) const = 0;
 
-    // determine the surface normal of this Shape at a given intersection point
-    virtual ray normal( vf3d incident ) const = 0;
+    // determine if this Shape intersects a given ray closer than max_distance
+    // this is all a shadow ray needs to know, so subclasses can override it with something cheaper
+    virtual bool occluded( ray r, float max_distance ) const {
+        return intersection( r ).value_or( INFINITY ) < max_distance;
+    }
+
+    // complete a hit record (with hit.point filled in) with the surface normal and coordinates of this Shape at that point
+    virtual void surface( hit_record &hit ) const = 0;
+
+    // get the bounding box of this Shape - infinite Shapes (like a Plane) have no bounds
+    virtual std::optional<aabb> bounds() const { return {}; }
 };
 
 // subclass of Shape that represents a Sphere
-class Sphere : public Shape {
+class Sphere final : public Shape {
 public:
     float radius;
 
@@ -159,14 +497,42 @@ public:
         return ret;
     }
 
-    // returns the surface normal of this Sphere at a given intersection point
-    ray normal( vf3d incident ) const override {
-        return { incident, (incident - origin).normalize() };
+    // determine if this Sphere intersects a given ray closer than max_distance
+    // this gives the same answer as intersection(), but needs no square root: the nearest root
+    // (-b - sqrt( discriminant )) / 2a lies in [0, max_distance) if and only if
+    //   b <= 0 and c >= 0                                     (the root is not negative), and
+    //   k < 0 or k * k < discriminant, with k = -b - 2a * max_distance   (the root is below max_distance)
+    bool occluded( ray r, float max_distance ) const override {
+        vf3d oc = r.origin - origin;
+
+        float b = 2.0f * (oc * r.direction);
+        if (b > 0.0f)
+            return false;
+        float c = (oc * oc) - (radius * radius);
+        if (c < 0.0f)
+            return false;
+        float a = r.direction * r.direction;
+        float discriminant = (b * b) - 4.0f * a * c;
+        if (discriminant < 0.0f)
+            return false;
+        float k = -b - 2.0f * a * max_distance;
+        return k < 0.0f || k * k < discriminant;
+    }
+
+    // sets the surface normal of this Sphere at the hit point
+    // Spheres aren't textured, so they leave the surface coordinates at 0
+    void surface( hit_record &hit ) const override {
+        hit.normal = (hit.point - origin).normalize();
+    }
+
+    // returns the bounding box of this Sphere
+    std::optional<aabb> bounds() const override {
+        return aabb( origin - radius, origin + radius );
     }
 };
 
 // subclass of Shape that represents a flat Plane
-class Plane : public Shape {
+class Plane final : public Shape {
 public:
     vf3d direction;
 	color3 check_color;
@@ -184,287 +550,5352 @@ public:
         return {};
     }
 
-    // get the color of this Plane (when intersecting with a given ray)
-    // we're overriding this to provide a checkerboard pattern
-    color3 sample( ray sample_ray ) const override {
-        // get the point of intersection
-        auto intersect = (sample_ray * intersection( sample_ray ).value_or( 0.0f )).end();
+    // determine if this Plane intersects a given ray closer than max_distance
+    bool occluded( ray sample_ray, float max_distance ) const override {
+        auto denom = direction * sample_ray.direction;
+        if (fabs( denom ) > 0.001f) {
+            auto distance = (origin - sample_ray.origin) * direction / denom;
+            return distance > 0 && distance < max_distance;
+        }
+        return false;
+    }
+
+    // sets the surface normal of this Plane, and uses the distance along the X and Z axis from
+    // the origin to the hit point as surface coordinates
+    void surface( hit_record &hit ) const override {
+        hit.normal = direction;
+        hit.u = origin.x - hit.point.x;
+        hit.v = origin.z - hit.point.z;
+    }
 
+    // get the color of this Plane at a given hit
+    // we're overriding this to provide a checkerboard pattern
+    color3 sample( const hit_record &hit ) const override {
         // get the distance along the X and Z axis from the origin to the intersection
-        float diffX = origin.x - intersect.x;
-        float diffZ = origin.z - intersect.z;
+        float diffX = hit.u;
+        float diffZ = hit.v;
 
         // get the XOR the signedness of the differences along X and Z
         // This allows us to "invert"the +X, -Z and -X, +Z quadrants
         bool color = (diffX < 0) ^ (diffZ < 0);
 
         // flip the "color" boolean if diff % 100 < 50 (e.g. flip one half of eacht 100-unit span)
-        if (fmod( fabs( diffZ ), 100) < 50) color = !color;
-        if (fmod( fabs( diffX ), 100) < 50) color = !color;
+#ifdef RT_FAST_MATH
+        color ^= CheckerSpanFast( diffZ ) ^ CheckerSpanFast( diffX );
+#else
+        if (CheckerSpanExact( diffZ )) color = !color;
+        if (CheckerSpanExact( diffX )) color = !color;
+#endif
 
         // if we're coloring this pixel, return the fill - otherwise return DARK_GREY
         if (color)
             return fill;
         return check_color;
     }
+};
+
+// bump allocator for the Shapes of a scene: they are packed one after the other into big cache line aligned blocks,
+// instead of each being a separate heap allocation somewhere. Reset() frees all of them at once (and keeps the blocks
+// for the next scene) - Shapes only hold plain values, so their destructors don't need to run.
+class ShapeArena {
+public:
+    static constexpr size_t BLOCK_SIZE      = 1 << 20;
+    static constexpr size_t BLOCK_ALIGNMENT = 64;
 
-    // return the surface normal of this Plane at a given intersection point
-    ray normal( vf3d incident ) const override {
-        return { incident, direction };
+    ShapeArena() = default;
+    ~ShapeArena() {
+        for (uint8_t *block : blocks)
+            ::operator delete( block, std::align_val_t( BLOCK_ALIGNMENT ));
     }
-};
 
-// Game width and height (in pixels)
-constexpr int WIDTH   = 400;
-constexpr int HEIGHT  = 400;
+    ShapeArena( const ShapeArena & ) = delete;
+    ShapeArena &operator=( const ShapeArena & ) = delete;
 
-constexpr int PIXEL_X =   1;
-constexpr int PIXEL_Y =   1;
+    // create a T in the arena
+    template <typename T, typename... Args>
+    T *Make( Args &&... args ) {
+        static_assert( sizeof( T ) <= BLOCK_SIZE && alignof( T ) <= BLOCK_ALIGNMENT, "T doesn't fit in a block" );
+        return new (Allocate( sizeof( T ), alignof( T ))) T( std::forward<Args>( args )... );
+    }
 
-// Half the game width and height (to identify the center of the screen)
-constexpr float HALF_WIDTH  = WIDTH  / 2.0f;
-constexpr float HALF_HEIGHT = HEIGHT / 2.0f;
+    // forget everything in the arena
+    void Reset() {
+        current = 0;
+        used    = 0;
+    }
 
-// lighting
-constexpr float AMBIENT_LIGHT = 0.5f;
+    void Swap( ShapeArena &other ) {
+        std::swap( blocks,  other.blocks );
+        std::swap( current, other.current );
+        std::swap( used,    other.used );
+    }
 
-// colors
-color3 DARK_GREY(  0.5f );
-color3 LIGHT_GREY( 0.8f );
-color3 GREY(       0.7f );
-color3 WHITE(      1.0f );
+private:
+    std::vector<uint8_t *> blocks;
+    size_t current = 0;   // the block that is being filled
+    size_t used    = 0;   // the number of bytes of that block in use
 
-color3 RED(       1.0f, 0.0f, 0.0f );
-color3 GREEN(     0.0f, 1.0f, 0.0f );
-color3 BLUE(      0.0f, 0.0f, 1.0f );
-color3 YELLOW(    0.0f, 1.0f, 1.0f );
-color3 DARK_BLUE( 0.0f, 0.0f, 0.3f );
+    void *Allocate( size_t size, size_t alignment ) {
+        size_t start = (used + alignment - 1) & ~(alignment - 1);
+        if (current >= blocks.size() || start + size > BLOCK_SIZE) {
+            // continue in the next block, allocating a new one if all of them are in use
+            if (current < blocks.size())
+                current++;
+            if (current == blocks.size())
+                blocks.push_back( static_cast<uint8_t *>( ::operator new( BLOCK_SIZE, std::align_val_t( BLOCK_ALIGNMENT ))));
+            start = 0;
+        }
+        used = start + size;
+        return blocks[current] + start;
+    }
+};
 
-// Fog distance and reciprocal (falloff)
-constexpr float FOG_INTENSITY_INVERSE = 6000.0f;
-constexpr float FOG_INTENSITY = 1.0f / FOG_INTENSITY_INVERSE;
+// By default the Shapes of the scene are allocated from a ShapeArena, and all calls on them are virtual.
+// With RT_SHAPE_VARIANT defined, the Shapes are stored by value in a std::variant instead,
+// so they are contiguous in memory, and VisitShape() calls the concrete (final) class directly, which allows
+// the compiler to inline e.g. Sphere::intersection() into the traversal loops.
+#ifdef RT_SHAPE_VARIANT
+using ShapeStorage = std::variant<Sphere, Plane>;
+#else
+using ShapeStorage = Shape *;   // owned by the ShapeArena of the scene
+#endif // RT_SHAPE_VARIANT
 
-// a color representing scene fog
-color3 FOG = GREY;
+// the container type for the Shapes in our scene
+using ShapeList = std::vector<ShapeStorage>;
 
+// create a Shape of type T in the storage form that's selected (in arena, unless it's stored by value)
+template <typename T, typename... Args>
+ShapeStorage MakeShape( ShapeArena &arena, Args &&... args ) {
+#ifdef RT_SHAPE_VARIANT
+    (void)arena;
+    return ShapeStorage( std::in_place_type<T>, std::forward<Args>( args )... );
+#else
+    return arena.Make<T>( std::forward<Args>( args )... );
+#endif
+}
 
-#define DEBUG
+// create a copy of a stored Shape (in arena, unless it's stored by value)
+inline ShapeStorage CopyShape( const ShapeStorage &shape, ShapeArena &arena ) {
+#ifdef RT_SHAPE_VARIANT
+    (void)arena;
+    return shape;
+#else
+    if (const Sphere *sphere = dynamic_cast<const Sphere *>( shape ))
+        return arena.Make<Sphere>( *sphere );
+    return arena.Make<Plane>( dynamic_cast<const Plane &>( *shape ));
+#endif
+}
 
-#ifdef DEBUG
-constexpr int BOUNCES = 2;
-constexpr int SAMPLES = 2;
+// call f with the stored Shape - as its concrete type for a variant, or as a Shape for a pointer into the ShapeArena
+template <typename F>
+decltype(auto) VisitShape( const ShapeStorage &shape, F &&f ) {
+#ifdef RT_SHAPE_VARIANT
+    return std::visit( std::forward<F>( f ), shape );
 #else
-constexpr int BOUNCES = 5;
-constexpr int SAMPLES = 4;
-#endif // DEBUG
+    return f( *shape );
+#endif
+}
 
+// access the stored Shape through its base class (for code that's not performance critical)
+inline const Shape &AsShape( const ShapeStorage &shape ) {
+    return VisitShape( shape, []( const Shape &s ) -> const Shape & { return s; } );
+}
+inline Shape &AsShape( ShapeStorage &shape ) {
+    return const_cast<Shape &>( AsShape( static_cast<const ShapeStorage &>( shape )));
+}
 
-class RayTracer : public olc::PixelGameEngine {
-public:
-    RayTracer() {
-        sAppName = "RayTracer";
+// the order of the Shapes along a Morton (Z-order) curve through the centers of their bounds, which keeps Shapes
+// that are close together in the scene close together in the order - Shapes without bounds go last
+inline std::vector<int> MortonOrder( const ShapeList &shapes ) {
+    std::vector<std::optional<aabb>> bounds( shapes.size());
+    aabb centers;
+    for (size_t i = 0; i < shapes.size(); i++) {
+        bounds[i] = AsShape( shapes[i] ).bounds();
+        if (bounds[i])
+            centers.grow( bounds[i]->centroid());
     }
 
-public:
-    bool OnUserCreate() override {
+    // spread the lowest 10 bits of v out over 30 bits, with two zero bits between each of them
+    auto spread = []( uint32_t v ) {
+        v = (v | (v << 16)) & 0x030000FFu;
+        v = (v | (v <<  8)) & 0x0300F00Fu;
+        v = (v | (v <<  4)) & 0x030C30C3u;
+        v = (v | (v <<  2)) & 0x09249249u;
+        return v;
+    };
+    // quantize a coordinate to 10 bits within the range of the centers
+    auto quantize = []( float value, float min, float max ) {
+        return max > min ? uint32_t( std::clamp( (value - min) / (max - min), 0.0f, 1.0f ) * 1023.0f ) : 0u;
+    };
+
+    std::vector<std::pair<uint32_t, int>> keys( shapes.size());
+    for (size_t i = 0; i < shapes.size(); i++) {
+        uint32_t key = UINT32_MAX;
+        if (bounds[i]) {
+            vf3d c = bounds[i]->centroid();
+            key = (spread( quantize( c.x, centers.min.x, centers.max.x )) << 2) |
+                  (spread( quantize( c.y, centers.min.y, centers.max.y )) << 1) |
+                   spread( quantize( c.z, centers.min.z, centers.max.z ));
+        }
+        keys[i] = { key, int( i ) };
+    }
+    std::sort( keys.begin(), keys.end());
 
-		// create a new Sphere and add it to our scene
-        shapes.emplace_back( std::make_unique<Sphere>( vf3d( 0, 0, 200 ), YELLOW, 100.0f, 0.8f ));
-        // add some additional Spheres at different positions
-        shapes.emplace_back( std::make_unique<Sphere>( vf3d( 0, 0, 200 ), RED   , 100.0f, 0.5f ));
-        shapes.emplace_back( std::make_unique<Sphere>( vf3d( 0, 0, 200 ), GREEN , 100.0f, 0.2f ));
-        // also add a "floor" Plane
-        shapes.emplace_back( std::make_unique<Plane>(vf3d( 0, 300, 0 ), vf3d( 0, -1, 0 ), BLUE, WHITE ));
+    std::vector<int> order( shapes.size());
+    for (size_t i = 0; i < shapes.size(); i++)
+        order[i] = keys[i].second;
+    return order;
+}
+
+// number of Spheres that the intersection kernels process per instruction
+#if defined(RT_SIMD) && defined(__AVX512F__)
+constexpr int SIMD_WIDTH = 16;
+#elif defined(RT_SIMD)
+constexpr int SIMD_WIDTH =  8;
+#else
+constexpr int SIMD_WIDTH =  1;
+#endif
 
-        light_point = { 0, -500, -500 };
+#ifdef RT_SIMD
+// structure-of-arrays copy of the Sphere geometry, so that the intersection kernels can load SIMD_WIDTH
+// Spheres with a single instruction per component. Entries that aren't Spheres get a negative radius2,
+// which makes the kernels miss them. The arrays are padded with such entries, so the kernels may read
+// up to SIMD_WIDTH - 1 entries beyond the end without any checks.
+struct SphereStore {
+    std::vector<float> x, y, z, radius2;
 
-        return true;
+    // resize to hold count entries (plus padding), all initialized to "not a Sphere"
+    void Resize( int count ) {
+        int padded = count + SIMD_WIDTH;
+        x.assign( padded, 0.0f );
+        y.assign( padded, 0.0f );
+        z.assign( padded, 0.0f );
+        radius2.assign( padded, -1.0f );
     }
 
-    bool OnUserUpdate( float fElapsedTime ) override {
-		// Called once per frame
+    // copy the geometry of shape into entry i (if it is a Sphere)
+    void Set( int i, const Shape &shape ) {
+        if (const Sphere *sphere = dynamic_cast<const Sphere *>( &shape )) {
+            x[i] = sphere->origin.x;
+            y[i] = sphere->origin.y;
+            z[i] = sphere->origin.z;
+            radius2[i] = sphere->radius * sphere->radius;
+        }
+    }
 
-        // create some static storage to accumulate elapsed time...
-        static float accumulated_time = 0.0f;
-        // ... and accumulate elapsed time into it
-        accumulated_time += fElapsedTime;
-
-        // update the position of our first Sphere evere update
-        // sin/cos = easy, cheap motion
-//        Shape &shape0 = *shapes.at(0);
-//        shape0.origin.y = sinf( accumulated_time ) * 100 - 100;
-//        shape0.origin.z = cosf( accumulated_time ) * 100 + 100;
-        Shape &shape1 = *shapes.at(1);
-        shape1.origin.x = sinf( accumulated_time ) * 200;
-        shape1.origin.y = cosf( accumulated_time ) * 200;
-        Shape &shape2 = *shapes.at(2);
-        shape2.origin.x = sinf( accumulated_time / 3.0f ) * 300;
-        shape2.origin.z = cosf( accumulated_time / 3.0f ) * 300 + 200;
-
-		// Iterate over the rows and columns of the scene
-        for (int y = 0; y < HEIGHT; y++) {
-		    for (int x = 0; x < WIDTH; x++) {
-                // create an array of colors - we'll be sampling this pixel multiple times when varying
-                // offsets to create a multisample, and then rendering the average of these samples.
-                std::array<color3, SAMPLES> samples;
-
-                for (int i = 0; i < SAMPLES; i++) {
-                    // create a random offset within this pixel
-                    float offsetX = rand() / (float)RAND_MAX;
-                    float offsetY = rand() / (float)RAND_MAX;
-                    // sample the color at that offset
-                    samples[i] = rtSample( x - HALF_WIDTH + offsetX, y - HALF_HEIGHT + offsetY );
-                }
-                // calculate the average color and draw it
-                color3 color = std::accumulate( samples.begin(), samples.end(), color3() ) / (float)SAMPLES;
-				Draw(x, y, olc::PixelF( color.x, color.y, color.z ));
-		    }
+    bool IsSphere( int i ) const { return radius2[i] >= 0.0f; }
+
+    // find the closest Sphere among entries [first, first + count) that ray r intersects closer than closest_distance
+    // returns its entry index (or -1) and updates closest_distance - this uses the same formula as Sphere::intersection()
+    int ClosestHit( const ray &r, int first, int count, float &closest_distance ) const {
+        int closest_entry = -1;
+        float a = r.direction * r.direction;
+#if defined(__AVX512F__)
+        __m512 dx = _mm512_set1_ps( r.direction.x ), dy = _mm512_set1_ps( r.direction.y ), dz = _mm512_set1_ps( r.direction.z );
+        __m512 ox = _mm512_set1_ps( r.origin.x    ), oy = _mm512_set1_ps( r.origin.y    ), oz = _mm512_set1_ps( r.origin.z    );
+        __m512 four_a = _mm512_set1_ps( 4.0f * a ), two_a = _mm512_set1_ps( 2.0f * a );
+        for (int j = first; j < first + count; j += SIMD_WIDTH) {
+            __m512 ocx = _mm512_sub_ps( ox, _mm512_loadu_ps( &x[j] ));
+            __m512 ocy = _mm512_sub_ps( oy, _mm512_loadu_ps( &y[j] ));
+            __m512 ocz = _mm512_sub_ps( oz, _mm512_loadu_ps( &z[j] ));
+            __m512 r2  = _mm512_loadu_ps( &radius2[j] );
+            __m512 b = _mm512_mul_ps( _mm512_set1_ps( 2.0f ), _mm512_add_ps( _mm512_add_ps( _mm512_mul_ps( ocx, dx ), _mm512_mul_ps( ocy, dy )), _mm512_mul_ps( ocz, dz )));
+            __m512 c = _mm512_sub_ps( _mm512_add_ps( _mm512_add_ps( _mm512_mul_ps( ocx, ocx ), _mm512_mul_ps( ocy, ocy )), _mm512_mul_ps( ocz, ocz )), r2 );
+            __m512 discriminant = _mm512_sub_ps( _mm512_mul_ps( b, b ), _mm512_mul_ps( four_a, c ));
+            __m512 t = _mm512_div_ps( _mm512_sub_ps( _mm512_sub_ps( _mm512_setzero_ps(), b ), _mm512_sqrt_ps( _mm512_max_ps( discriminant, _mm512_setzero_ps()))), two_a );
+            __mmask16 valid = _mm512_cmp_ps_mask( discriminant, _mm512_setzero_ps(), _CMP_GE_OQ ) &
+                              _mm512_cmp_ps_mask( r2, _mm512_setzero_ps(), _CMP_GE_OQ ) &
+                              _mm512_cmp_ps_mask( t, _mm512_setzero_ps(), _CMP_GE_OQ ) &
+                              _mm512_cmp_ps_mask( t, _mm512_set1_ps( closest_distance ), _CMP_LT_OQ ) &
+                              __mmask16( count - (j - first) >= 16 ? 0xFFFF : (1u << (count - (j - first))) - 1 );
+            if (valid) {
+                float t_min = _mm512_mask_reduce_min_ps( valid, t );
+                int lane = __builtin_ctz( _mm512_mask_cmp_ps_mask( valid, t, _mm512_set1_ps( t_min ), _CMP_EQ_OQ ));
+                closest_distance = t_min;
+                closest_entry = j + lane;
+            }
+        }
+#else
+        __m256 dx = _mm256_set1_ps( r.direction.x ), dy = _mm256_set1_ps( r.direction.y ), dz = _mm256_set1_ps( r.direction.z );
+        __m256 ox = _mm256_set1_ps( r.origin.x    ), oy = _mm256_set1_ps( r.origin.y    ), oz = _mm256_set1_ps( r.origin.z    );
+        __m256 four_a = _mm256_set1_ps( 4.0f * a ), two_a = _mm256_set1_ps( 2.0f * a );
+        __m256 lanes = _mm256_setr_ps( 0, 1, 2, 3, 4, 5, 6, 7 );
+        for (int j = first; j < first + count; j += SIMD_WIDTH) {
+            __m256 ocx = _mm256_sub_ps( ox, _mm256_loadu_ps( &x[j] ));
+            __m256 ocy = _mm256_sub_ps( oy, _mm256_loadu_ps( &y[j] ));
+            __m256 ocz = _mm256_sub_ps( oz, _mm256_loadu_ps( &z[j] ));
+            __m256 r2  = _mm256_loadu_ps( &radius2[j] );
+            __m256 b = _mm256_mul_ps( _mm256_set1_ps( 2.0f ), _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( ocx, dx ), _mm256_mul_ps( ocy, dy )), _mm256_mul_ps( ocz, dz )));
+            __m256 c = _mm256_sub_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( ocx, ocx ), _mm256_mul_ps( ocy, ocy )), _mm256_mul_ps( ocz, ocz )), r2 );
+            __m256 discriminant = _mm256_sub_ps( _mm256_mul_ps( b, b ), _mm256_mul_ps( four_a, c ));
+            __m256 t = _mm256_div_ps( _mm256_sub_ps( _mm256_sub_ps( _mm256_setzero_ps(), b ), _mm256_sqrt_ps( _mm256_max_ps( discriminant, _mm256_setzero_ps()))), two_a );
+            __m256 valid = _mm256_and_ps(
+                _mm256_and_ps( _mm256_cmp_ps( discriminant, _mm256_setzero_ps(), _CMP_GE_OQ ), _mm256_cmp_ps( r2, _mm256_setzero_ps(), _CMP_GE_OQ )),
+                _mm256_and_ps( _mm256_and_ps( _mm256_cmp_ps( t, _mm256_setzero_ps(), _CMP_GE_OQ ), _mm256_cmp_ps( t, _mm256_set1_ps( closest_distance ), _CMP_LT_OQ )),
+                               _mm256_cmp_ps( lanes, _mm256_set1_ps( float( count - (j - first) )), _CMP_LT_OQ )));
+            if (_mm256_movemask_ps( valid ) == 0)
+                continue;
+            // horizontal minimum over the valid lanes
+            __m256 tv = _mm256_blendv_ps( _mm256_set1_ps( INFINITY ), t, valid );
+            __m256 m  = _mm256_min_ps( tv, _mm256_permute2f128_ps( tv, tv, 1 ));
+            m = _mm256_min_ps( m, _mm256_shuffle_ps( m, m, _MM_SHUFFLE( 1, 0, 3, 2 )));
+            m = _mm256_min_ps( m, _mm256_shuffle_ps( m, m, _MM_SHUFFLE( 2, 3, 0, 1 )));
+            int lane = __builtin_ctz( _mm256_movemask_ps( _mm256_cmp_ps( tv, m, _CMP_EQ_OQ )));
+            closest_distance = _mm256_cvtss_f32( m );
+            closest_entry = j + lane;
         }
+#endif
+        return closest_entry;
+    }
 
-		return true;
+    // returns true if ray r intersects any Sphere among entries [first, first + count) closer than max_distance
+    // this uses the same square root free test as Sphere::occluded()
+    bool Occluded( const ray &r, int first, int count, float max_distance ) const {
+        float a = r.direction * r.direction;
+#if defined(__AVX512F__)
+        __m512 dx = _mm512_set1_ps( r.direction.x ), dy = _mm512_set1_ps( r.direction.y ), dz = _mm512_set1_ps( r.direction.z );
+        __m512 ox = _mm512_set1_ps( r.origin.x    ), oy = _mm512_set1_ps( r.origin.y    ), oz = _mm512_set1_ps( r.origin.z    );
+        __m512 zero = _mm512_setzero_ps(), four_a = _mm512_set1_ps( 4.0f * a ), two_a_max = _mm512_set1_ps( 2.0f * a * max_distance );
+        for (int j = first; j < first + count; j += SIMD_WIDTH) {
+            __m512 ocx = _mm512_sub_ps( ox, _mm512_loadu_ps( &x[j] ));
+            __m512 ocy = _mm512_sub_ps( oy, _mm512_loadu_ps( &y[j] ));
+            __m512 ocz = _mm512_sub_ps( oz, _mm512_loadu_ps( &z[j] ));
+            __m512 r2  = _mm512_loadu_ps( &radius2[j] );
+            __m512 b = _mm512_mul_ps( _mm512_set1_ps( 2.0f ), _mm512_add_ps( _mm512_add_ps( _mm512_mul_ps( ocx, dx ), _mm512_mul_ps( ocy, dy )), _mm512_mul_ps( ocz, dz )));
+            __m512 c = _mm512_sub_ps( _mm512_add_ps( _mm512_add_ps( _mm512_mul_ps( ocx, ocx ), _mm512_mul_ps( ocy, ocy )), _mm512_mul_ps( ocz, ocz )), r2 );
+            __m512 discriminant = _mm512_sub_ps( _mm512_mul_ps( b, b ), _mm512_mul_ps( four_a, c ));
+            __m512 k = _mm512_sub_ps( _mm512_sub_ps( zero, b ), two_a_max );
+            __mmask16 hit = _mm512_cmp_ps_mask( b, zero, _CMP_LE_OQ ) &
+                            _mm512_cmp_ps_mask( c, zero, _CMP_GE_OQ ) &
+                            _mm512_cmp_ps_mask( r2, zero, _CMP_GE_OQ ) &
+                            _mm512_cmp_ps_mask( discriminant, zero, _CMP_GE_OQ ) &
+                            (_mm512_cmp_ps_mask( k, zero, _CMP_LT_OQ ) | _mm512_cmp_ps_mask( _mm512_mul_ps( k, k ), discriminant, _CMP_LT_OQ )) &
+                            __mmask16( count - (j - first) >= 16 ? 0xFFFF : (1u << (count - (j - first))) - 1 );
+            if (hit)
+                return true;
+        }
+#else
+        __m256 dx = _mm256_set1_ps( r.direction.x ), dy = _mm256_set1_ps( r.direction.y ), dz = _mm256_set1_ps( r.direction.z );
+        __m256 ox = _mm256_set1_ps( r.origin.x    ), oy = _mm256_set1_ps( r.origin.y    ), oz = _mm256_set1_ps( r.origin.z    );
+        __m256 zero = _mm256_setzero_ps(), four_a = _mm256_set1_ps( 4.0f * a ), two_a_max = _mm256_set1_ps( 2.0f * a * max_distance );
+        __m256 lanes = _mm256_setr_ps( 0, 1, 2, 3, 4, 5, 6, 7 );
+        for (int j = first; j < first + count; j += SIMD_WIDTH) {
+            __m256 ocx = _mm256_sub_ps( ox, _mm256_loadu_ps( &x[j] ));
+            __m256 ocy = _mm256_sub_ps( oy, _mm256_loadu_ps( &y[j] ));
+            __m256 ocz = _mm256_sub_ps( oz, _mm256_loadu_ps( &z[j] ));
+            __m256 r2  = _mm256_loadu_ps( &radius2[j] );
+            __m256 b = _mm256_mul_ps( _mm256_set1_ps( 2.0f ), _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( ocx, dx ), _mm256_mul_ps( ocy, dy )), _mm256_mul_ps( ocz, dz )));
+            __m256 c = _mm256_sub_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( ocx, ocx ), _mm256_mul_ps( ocy, ocy )), _mm256_mul_ps( ocz, ocz )), r2 );
+            __m256 discriminant = _mm256_sub_ps( _mm256_mul_ps( b, b ), _mm256_mul_ps( four_a, c ));
+            __m256 k = _mm256_sub_ps( _mm256_sub_ps( zero, b ), two_a_max );
+            __m256 hit = _mm256_and_ps(
+                _mm256_and_ps( _mm256_and_ps( _mm256_cmp_ps( b, zero, _CMP_LE_OQ ), _mm256_cmp_ps( c, zero, _CMP_GE_OQ )),
+                               _mm256_and_ps( _mm256_cmp_ps( r2, zero, _CMP_GE_OQ ), _mm256_cmp_ps( discriminant, zero, _CMP_GE_OQ ))),
+                _mm256_and_ps( _mm256_or_ps( _mm256_cmp_ps( k, zero, _CMP_LT_OQ ), _mm256_cmp_ps( _mm256_mul_ps( k, k ), discriminant, _CMP_LT_OQ )),
+                               _mm256_cmp_ps( lanes, _mm256_set1_ps( float( count - (j - first) )), _CMP_LT_OQ )));
+            if (_mm256_movemask_ps( hit ) != 0)
+                return true;
+        }
+#endif
+        return false;
     }
+};
+#endif // RT_SIMD
 
-    color3 rtSample( float x, float y ) const {
+// bounding volume hierarchy over the finite Shapes of a scene
+// The tree is built top down using the surface area heuristic (SAH), and is stored depth first in a
+// flat array of nodes: the left child of an interior node directly follows it, and the node stores
+// the index of its right child. Infinite Shapes (like Planes) can't be bounded, so they are kept in
+// a separate (short) list that is tested linearly.
+class BVH {
+public:
+    // the traversal stacks hold this many nodes, so trees are at most STACK_SIZE - 1 levels deep (Build() keeps them
+    // within that, and Read() rejects deeper ones)
+    static constexpr int STACK_SIZE = 64;
 
-        // create a ray casting into the scene from this "pixel"
-        ray sample_ray({ 0, 0, -800 }, { (x / float(WIDTH)) * 100, (y / float(HEIGHT)) * 100, 200 });
+    // (re)build the hierarchy for the given Shapes, leaving out the ones that are excluded
+    // the indices of the hits still refer to shapes, so it's queried with the same list
+    void Build( const ShapeList &shapes, const std::vector<bool> &excluded = {} ) {
+        nodes.clear();
+        prims.clear();
+        unbounded.clear();
+        prim_bounds.assign( shapes.size(), aabb());
 
-        // sample this ray - if the ray doesn't hit anything, use the color of the fog
-        return SampleRay( sample_ray.normalize(), BOUNCES ).value_or( FOG );
+        for (int i = 0; i < (int)shapes.size(); i++) {
+            if (i < (int)excluded.size() && excluded[i])
+                continue;
+            if (std::optional<aabb> box = AsShape( shapes[i] ).bounds()) {
+                prim_bounds[i] = box.value();
+                prims.push_back( i );
+            } else {
+                unbounded.push_back( i );
+            }
+        }
+        if (!prims.empty())
+            BuildNode( 0, (int)prims.size() );
+        build_cost = Cost();
+        FillStore( shapes );
+        IndexNodes( shapes );
     }
 
-    std::optional<color3> SampleRay( ray r, int bounces ) const {
-        bounces -= 1;
+    // append the hierarchy to a scene file (see SceneFileWriter), so it doesn't need to be built again when it's loaded
+    // all values are 4 bytes: the number of nodes, prims and unbounded Shapes and a zero, then per node the corners of
+    // its box and first and count, then the prims and the unbounded Shapes
+    bool Write( FILE *file ) const {
+        std::vector<uint32_t> data = { uint32_t( nodes.size()), uint32_t( prims.size()), uint32_t( unbounded.size()), 0 };
+        for (const Node &node : nodes) {
+            for (float value : { node.box.min.x, node.box.min.y, node.box.min.z, node.box.max.x, node.box.max.y, node.box.max.z }) {
+                uint32_t bits;
+                memcpy( &bits, &value, sizeof( bits ));
+                data.push_back( bits );
+            }
+            data.push_back( uint32_t( node.first ));
+            data.push_back( uint32_t( node.count ));
+        }
+        data.insert( data.end(), prims.begin(), prims.end());
+        data.insert( data.end(), unbounded.begin(), unbounded.end());
+        return fwrite( data.data(), sizeof( uint32_t ), data.size(), file ) == data.size();
+    }
 
-        // called to get the color produced by a specific ray
-        // this will be the color we (eventually) return
-        color3 final_color;
+    // the hierarchy as flat arrays (for the GPU backend): per node the corners of its box, and first and count
+    void Flatten( std::vector<float> &boxes, std::vector<int> &links, std::vector<int> &leaf_prims, std::vector<int> &unbounded_shapes ) const {
+        boxes.clear();
+        links.clear();
+        for (const Node &node : nodes) {
+            boxes.insert( boxes.end(), { node.box.min.x, node.box.min.y, node.box.min.z, node.box.max.x, node.box.max.y, node.box.max.z } );
+            links.insert( links.end(), { node.first, node.count } );
+        }
+        leaf_prims       = prims;
+        unbounded_shapes = unbounded;
+    }
 
-        // store a pointer to the Shape this ray intersects with
-        auto intersected_shape_iterator = shapes.end();
-        // also store the distance along the ray where the intersection occurs
-        float intersection_distance = INFINITY;
+    // take over a hierarchy written by Write() for the same shapes, from size bytes at data
+    // returns false (leaving the BVH empty) if it doesn't fit these Shapes, or it can't be traversed
+    bool Read( const uint8_t *data, size_t size, const ShapeList &shapes ) {
+        nodes.clear();
+        prims.clear();
+        unbounded.clear();
+        prim_bounds.clear();
 
-        // iterate over all Shapes in our scene
-        for (auto it = shapes.begin(); it != shapes.end(); it++) {
-            // if the distance is not undefined (meaning no intersection)...
-            if (
-                std::optional<float> distance = (*it)->intersection(r).value_or(INFINITY);
-                distance < intersection_distance
-            ) {
-                // save the current shape as the intersected shape!
-                intersected_shape_iterator = it;
-                // also save the distance along the ray that this intersection occurred
-                intersection_distance = distance.value();
+        auto read = [&]( size_t index ) {
+            uint32_t value;
+            memcpy( &value, data + index * sizeof( uint32_t ), sizeof( value ));
+            return value;
+        };
+        if (size < 4 * sizeof( uint32_t ))
+            return false;
+        size_t node_count = read( 0 ), prim_count = read( 1 ), unbounded_count = read( 2 );
+        if (size / sizeof( uint32_t ) < 4 + node_count * 8 + prim_count + unbounded_count)
+            return false;
+
+        bool valid = true;
+        // the depth of each node, whether it has been reached from its parent yet, and whether each prim (and Shape) is
+        // in the tree already - every one of them has to be in it exactly once
+        std::vector<int>  depth( node_count, 0 );
+        std::vector<bool> reached( node_count, false ), prim_used( prim_count, false ), shape_used( shapes.size(), false );
+        nodes.resize( node_count );
+        for (size_t n = 0; n < node_count && valid; n++) {
+            float corners[6];
+            for (int k = 0; k < 6; k++) {
+                uint32_t bits = read( 4 + n * 8 + k );
+                memcpy( &corners[k], &bits, sizeof( bits ));
+            }
+            Node &node = nodes[n];
+            node.box   = aabb( vf3d( corners[0], corners[1], corners[2] ), vf3d( corners[3], corners[4], corners[5] ));
+            node.first = int( read( 4 + n * 8 + 6 ));
+            node.count = int( read( 4 + n * 8 + 7 ));
+            // every node but the root has to be reached from its parent first (children come after their parent, which
+            // is what the traversal and Refit() rely on), and each only once, within the depth the traversal stack can
+            // handle - and the leaves have to cover each prim exactly once
+            valid = n == 0 || reached[n];
+            if (valid && node.count > 0) {
+                valid = node.first >= 0 && size_t( node.first ) + size_t( node.count ) <= prim_count;
+                for (int i = node.first; i < node.first + node.count && valid; i++) {
+                    valid = !prim_used[i];
+                    prim_used[i] = true;
+                }
+            } else if (valid) {
+                valid = node.count == 0 && node.first > int( n ) + 1 && size_t( node.first ) < node_count && depth[n] + 1 < STACK_SIZE &&
+                        !reached[n + 1] && !reached[node.first];
+                if (valid) {
+                    reached[n + 1] = reached[node.first] = true;
+                    depth[n + 1]   = depth[node.first]   = depth[n] + 1;
+                }
             }
         }
-        // if we didn't intersect with any Shapes, return an empty optional
-        if (intersected_shape_iterator == shapes.end())
-            return {};
-        // else get the shape we discovered
-        const Shape &intersected_shape = **intersected_shape_iterator;
+        valid = valid && std::find( prim_used.begin(), prim_used.end(), false ) == prim_used.end();
+        for (size_t i = 0; i < prim_count && valid; i++) {
+            uint32_t shape = read( 4 + node_count * 8 + i );
+            valid = shape < shapes.size() && !shape_used[shape] && AsShape( shapes[shape] ).bounds().has_value();
+            if (valid)
+                shape_used[shape] = true;
+            prims.push_back( int( shape ));
+        }
+        for (size_t i = 0; i < unbounded_count && valid; i++) {
+            uint32_t shape = read( 4 + node_count * 8 + prim_count + i );
+            valid = shape < shapes.size() && !shape_used[shape];
+            if (valid)
+                shape_used[shape] = true;
+            unbounded.push_back( int( shape ));
+        }
+        if (!valid || prims.size() + unbounded.size() != shapes.size() || (nodes.empty() != prims.empty())) {
+            nodes.clear();
+            prims.clear();
+            unbounded.clear();
+            return false;
+        }
 
-        // quick check - if the intersection is further away than the furthest Fog point,
-        // then we can save some time and not calculate anything further, since it would
-        // be obscured by Fog regardless.
-        if (intersection_distance >= FOG_INTENSITY_INVERSE)
-            return FOG;
+        // Refit() only needs to know the number of Shapes
+        prim_bounds.assign( shapes.size(), aabb());
+        build_cost = Cost();
+        FillStore( shapes );
+        IndexNodes( shapes );
+        return true;
+    }
+
+    // update the bounding boxes for Shapes that moved, without changing the structure of the tree
+    // the quality of the tree degrades when Shapes move a lot, so if the cost of the refitted tree grows
+    // too much compared to the freshly built one, the tree is rebuilt instead
+    void Refit( const ShapeList &shapes ) {
+        if (shapes.size() != prim_bounds.size()) {
+            Build( shapes );
+            return;
+        }
+        // children always come after their parent in the array, so walking it backwards is bottom up
+        for (int n = (int)nodes.size() - 1; n >= 0; n--) {
+            Node &node = nodes[n];
+            node.box = aabb();
+            if (node.count > 0) {
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    node.box.grow( AsShape( shapes[prims[i]] ).bounds().value());
+#ifdef RT_SIMD
+                    store.Set( i, AsShape( shapes[prims[i]] ));
+#endif
+                }
+            } else {
+                node.box.grow( nodes[n + 1].box );
+                node.box.grow( nodes[node.first].box );
+            }
+        }
+        cost_sum = CostSum();
+        if (Cost() > REBUILD_FACTOR * build_cost)
+            Build( shapes );
+    }
+
+    // the same, when only the Shapes in changed (indices into shapes) moved or changed size: this only updates the
+    // nodes above those Shapes, instead of the whole tree
+    void Refit( const ShapeList &shapes, const std::vector<int> &changed ) {
+        if (shapes.size() != prim_bounds.size() || changed.size() * 4 > shapes.size()) {
+            Refit( shapes );
+            return;
+        }
+        // collect the nodes on the paths from the leaves of the changed Shapes up to the root, each of them once
+        dirty_nodes.clear();
+        for (int shape : changed) {
+            for (int n = prim_leaf[shape]; n >= 0 && !node_dirty[n]; n = parents[n]) {
+                node_dirty[n] = true;
+                dirty_nodes.push_back( n );
+            }
+        }
+        // children always come after their parent in the array, so going from the highest index down is bottom up
+        std::sort( dirty_nodes.begin(), dirty_nodes.end(), std::greater<int>());
+        for (int n : dirty_nodes) {
+            Node &node = nodes[n];
+            node_dirty[n] = false;
+            cost_sum -= NodeCost( node );
+            node.box = aabb();
+            if (node.count > 0) {
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    node.box.grow( AsShape( shapes[prims[i]] ).bounds().value());
+#ifdef RT_SIMD
+                    store.Set( i, AsShape( shapes[prims[i]] ));
+#endif
+                }
+            } else {
+                node.box.grow( nodes[n + 1].box );
+                node.box.grow( nodes[node.first].box );
+            }
+            cost_sum += NodeCost( node );
+        }
+        if (!nodes.empty() && cost_sum / std::max( nodes[0].box.area(), 1e-6f ) > REBUILD_FACTOR * build_cost)
+            Build( shapes );
+    }
 
-        // set our color to the sampled color of the Shape that intersects with this ray
-        final_color = intersected_shape.sample(r);
+    // find the closest Shape that ray r intersects closer than t_max - returns a hit record with the distance and the
+    // index of that Shape filled in (shape_id is -1 if nothing is hit)
+    hit_record ClosestHit( const ray &r, const ShapeList &shapes, float t_max = INFINITY ) const {
+        RT_ZONE( "BVH::ClosestHit" );
+        int   closest_shape = -1;
+        float closest_distance = t_max;
 
-        // determine the point at which our ray intersects the Shape
-        vf3d intersection_point = (r * intersection_distance).end();
-        // calculate the normal of the given Shape at that point
-        ray normal = intersected_shape.normal( intersection_point );
+        for (int i : unbounded) {
+            if (float d = Intersection( shapes[i], r ); d < closest_distance) {
+                closest_distance = d;
+                closest_shape = i;
+            }
+        }
+        if (!nodes.empty()) {
+            vf3d inv_direction( 1.0f / r.direction.x, 1.0f / r.direction.y, 1.0f / r.direction.z );
+            // the stack holds the nodes still to visit, together with the distance where the ray enters them
+            std::pair<int, float> stack[STACK_SIZE];
+            int stack_size = 0;
+            stack[stack_size++] = { 0, nodes[0].box.intersection( r, inv_direction, closest_distance ) };
 
-        // apply reflection
-        if (bounces != 0 && intersected_shape.reflectivity > 0.0f) {
-            // our reflection ray starts out as our normal
-            ray reflection = normal;
-            // apply a slight offset *along* the normal. This way our reflected ray will start at
-            // some slight offset from the surface so that rounding errors don't cause it to collide
-            // with the Shape it originated from
-            reflection.origin = reflection.origin + (normal.direction + 0.001f);
-            // reflect the direction around the normal with some simple geometry
-            reflection.direction = (normal.direction * (2 * ((r.direction * -1.0f) * normal.direction)) + r.direction).normalize();
-            // recursion! since the SampleRay doesn't care if the ray is coming from the canvas,
-            // we can use it to get the color that will be reflected by this Shape
-            std::optional<color3> reflected_color = SampleRay( reflection, bounces );
+            while (stack_size > 0) {
+                auto [n, t_enter] = stack[--stack_size];
+                // skip nodes that are entered beyond the closest hit found so far
+                if (t_enter >= closest_distance)
+                    continue;
 
-            // finally, mix our Shape's colour with the reflected color (or Fog color, in case of a miss)
-            // according to the reflectivity
-            final_color = lerp( final_color, reflected_color.value_or( FOG ), intersected_shape.reflectivity );
+                const Node &node = nodes[n];
+                if (node.count > 0) {
+                    IntersectLeaf( node, r, shapes, closest_distance, closest_shape );
+                } else {
+                    // push the nearest child last, so that it's visited first and closest_distance shrinks as fast as possible
+                    int   near_child = n + 1, far_child = node.first;
+                    float t_near = nodes[near_child].box.intersection( r, inv_direction, closest_distance );
+                    float t_far  = nodes[far_child ].box.intersection( r, inv_direction, closest_distance );
+                    if (t_far < t_near) {
+                        std::swap( near_child, far_child );
+                        std::swap( t_near, t_far );
+                    }
+                    if (t_far  != INFINITY) stack[stack_size++] = { far_child,  t_far  };
+                    if (t_near != INFINITY) stack[stack_size++] = { near_child, t_near };
+                }
+            }
         }
+        hit_record hit;
+        hit.t = closest_shape < 0 ? INFINITY : closest_distance;
+        hit.shape_id = closest_shape;
+        return hit;
+    }
 
-        // apply lighting
+    // returns true if ray r intersects any Shape closer than max_distance
+    // this returns at the first Shape that is found, without looking for the closest one
+    bool AnyHit( const ray &r, const ShapeList &shapes, float max_distance ) const {
+        RT_ZONE( "BVH::AnyHit" );
+        for (int i : unbounded) {
+            if (Occluded( shapes[i], r, max_distance ))
+                return true;
+        }
+        if (nodes.empty())
+            return false;
 
-        // first get the (un-normalized) ray from our intersection point to the light source
-        ray light_ray = ray( intersection_point, light_point - intersection_point );
-        // get distance to the light (i.e. the length of tue un-normalized ray)
-        float light_distance = light_ray.direction.length();
-        // also offset the origin of the light ray with a small amount along the surface normal so the ray
-        // doesn't intersect with the shape itself
-        light_ray.origin = light_ray.origin + (normal.direction *  0.001f);
-        // and finally normalize the light_ray
-        light_ray.direction = light_ray.direction.normalize();
-        // then search for any Shape that is occluding the light ray, using more or less our existing search code.
-        // we initialize closest_distance to our light distance, because we don't care if any of the Shapes intersect the ray beyond the light
-        float closest_distance = light_distance;
-        for (auto &shape : shapes) {
-            if (float distance = shape->intersection( light_ray ).value_or( INFINITY ); distance < closest_distance) {
-                closest_distance = distance;
-            }
-        }
-        // check if we had an intersection (in that case the light is occluded)
-        if (closest_distance < light_distance) {
-            // multiply final color by the ambient light to darken the surface
-            final_color = final_color * AMBIENT_LIGHT;
-        } else {
-            // next compute the dot product between surface normal and light ray
-            // clamp this to prevent negative values
-            // additionally, add in the ambient light so no surfaces are entirely dark
-            float dot = std::clamp( AMBIENT_LIGHT + (light_ray.direction * normal.direction), 0.0f, 1.0f );
-            // multiplying final color by resulting dot product darkens surfaces pointing away from the light
-            final_color = final_color * dot;
+        vf3d inv_direction( 1.0f / r.direction.x, 1.0f / r.direction.y, 1.0f / r.direction.z );
+        int stack[STACK_SIZE];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+        while (stack_size > 0) {
+            int n = stack[--stack_size];
+            const Node &node = nodes[n];
+            if (node.box.intersection( r, inv_direction, max_distance ) == INFINITY)
+                continue;
+            if (node.count > 0) {
+                if (OccludedLeaf( node, r, shapes, max_distance ))
+                    return true;
+            } else {
+                stack[stack_size++] = node.first;
+                stack[stack_size++] = n + 1;
+            }
         }
+        return false;
+    }
 
-		// Apply Fog
-		if (FOG_INTENSITY)
-			final_color = lerp(final_color, FOG, intersection_distance * FOG_INTENSITY);
+    // find the closest hits for a packet of N rays at once - hits[k] receives the result for ray r[k], like ClosestHit()
+    // the rays in a packet should be coherent (like the primary rays of neighbouring pixels), so that they visit mostly
+    // the same nodes: the tree is walked once for the whole packet, and a node is entered if any of its rays hits it
+    template <int N>
+    void ClosestHitPacket( const ray (&r)[N], const ShapeList &shapes, hit_record (&hits)[N], float t_max = INFINITY ) const {
+        RT_ZONE( "BVH::ClosestHitPacket" );
+        vf3d inv_direction[N];
+        for (int k = 0; k < N; k++) {
+            hits[k] = hit_record();
+            hits[k].t = t_max;
+            inv_direction[k] = vf3d( 1.0f / r[k].direction.x, 1.0f / r[k].direction.y, 1.0f / r[k].direction.z );
+            for (int i : unbounded) {
+                if (float d = Intersection( shapes[i], r[k] ); d < hits[k].t) {
+                    hits[k].t = d;
+                    hits[k].shape_id = i;
+                }
+            }
+        }
+        if (nodes.empty()) {
+            ResetMisses( hits );
+            return;
+        }
 
-        return final_color;
+        // returns the nearest distance where any ray of the packet enters the box of node n
+        auto packet_intersection = [&]( int n ) {
+            float t_min = INFINITY;
+            for (int k = 0; k < N; k++)
+                t_min = std::min( t_min, nodes[n].box.intersection( r[k], inv_direction[k], hits[k].t ));
+            return t_min;
+        };
+
+        std::pair<int, float> stack[STACK_SIZE];
+        int stack_size = 0;
+        stack[stack_size++] = { 0, packet_intersection( 0 ) };
+        while (stack_size > 0) {
+            auto [n, t_enter] = stack[--stack_size];
+            if (t_enter == INFINITY)
+                continue;
+
+            const Node &node = nodes[n];
+            if (node.count > 0) {
+                for (int k = 0; k < N; k++) {
+                    if (node.box.intersection( r[k], inv_direction[k], hits[k].t ) != INFINITY)
+                        IntersectLeaf( node, r[k], shapes, hits[k].t, hits[k].shape_id );
+                }
+            } else {
+                int   near_child = n + 1, far_child = node.first;
+                float t_near = packet_intersection( near_child );
+                float t_far  = packet_intersection( far_child  );
+                if (t_far < t_near) {
+                    std::swap( near_child, far_child );
+                    std::swap( t_near, t_far );
+                }
+                if (t_far  != INFINITY) stack[stack_size++] = { far_child,  t_far  };
+                if (t_near != INFINITY) stack[stack_size++] = { near_child, t_near };
+            }
+        }
+        ResetMisses( hits );
     }
 
 private:
-    std::vector<std::unique_ptr<Shape>> shapes;
+    // a node is a leaf if count > 0; then it holds prims [first, first + count)
+    // otherwise it's an interior node, with its left child at the next index and its right child at index first
+    // (nodes are aligned, so two of them share a cache line and none straddles two)
+    struct alignas( 32 ) Node {
+        aabb box;
+        int first = 0;
+        int count = 0;
+    };
 
-    // the position of our point light
-    vf3d light_point;
+    // with SIMD the leaves are tested SIMD_WIDTH Shapes at a time, so bigger leaves are cheaper
+    static constexpr int   MAX_LEAF_SIZE     = std::max( 4, SIMD_WIDTH );   // nodes with more Shapes are always split
+    static constexpr int   SAH_BINS          = 12;                          // number of candidate split positions per axis
+    static constexpr float TRAVERSAL_COST    = 1.0f;                        // relative cost of testing a node...
+    static constexpr float INTERSECTION_COST = 1.0f / SIMD_WIDTH;           // ... vs. testing a Shape
+    static constexpr float REBUILD_FACTOR = 2.0f;    // rebuild if refitting makes the tree this much worse
+    // from this depth on nodes are split at the median instead of by the SAH: halving any (int) number of prims down
+    // to leaves takes less than 32 more levels, so skewed splits can't make the tree deeper than the traversal stacks
+    static constexpr int   MEDIAN_SPLIT_DEPTH = STACK_SIZE - 32;
 
-    // apply a linear interpolation between two colors
-    color3 lerp( color3 from, color3 to, float by ) const {
-        if (by <= 0.0f) return from;
-        if (by >= 1.0f) return to;
-        return color3(
-            from.x * (1.0f - by) + to.x * by,
-            from.y * (1.0f - by) + to.y * by,
-            from.z * (1.0f - by) + to.z * by
-        );
+    std::vector<Node> nodes;
+    std::vector<int>  prims;         // indices into the ShapeList, in leaf order
+    std::vector<int>  unbounded;     // indices of the Shapes that have no bounds
+    std::vector<aabb> prim_bounds;   // bounding box per Shape (only used while building)
+    float build_cost = 0.0f;
+    // for refitting part of the tree: the parent of each node (-1 for the root), the leaf of each Shape (-1 if it isn't
+    // in the tree), the SAH cost of the tree not yet divided by the area of the root, and the nodes to update
+    std::vector<int>  parents;
+    std::vector<int>  prim_leaf;
+    float             cost_sum = 0.0f;
+    std::vector<int>  dirty_nodes;
+    std::vector<bool> node_dirty;
+#ifdef RT_SIMD
+    SphereStore store;               // the geometry of the Sphere prims, in leaf order
+#endif
+
+    // the rays of a packet that didn't hit anything closer than t_max get the distance of a miss
+    template <int N>
+    static void ResetMisses( hit_record (&hits)[N] ) {
+        for (hit_record &hit : hits)
+            if (hit.shape_id < 0)
+                hit.t = INFINITY;
     }
 
-    bool OnUserDestroy() override {
-        // your clean up code here
-        return true;
+    // distance along ray r where it intersects shape, or INFINITY if it doesn't
+    static float Intersection( const ShapeStorage &shape, const ray &r ) {
+        return VisitShape( shape, [&]( const auto &s ) { return s.intersection( r ).value_or( INFINITY ); } );
+    }
+    // returns true if ray r intersects shape closer than max_distance
+    static bool Occluded( const ShapeStorage &shape, const ray &r, float max_distance ) {
+        return VisitShape( shape, [&]( const auto &s ) { return s.occluded( r, max_distance ); } );
     }
-};
 
-int main()
-{
-	RayTracer demo;
-	if (demo.Construct( WIDTH, HEIGHT, PIXEL_X, PIXEL_Y ))
-		demo.Start();
+    // intersect ray r with the Shapes in leaf node, updating closest_distance and closest_shape if a closer one is hit
+    void IntersectLeaf( const Node &node, const ray &r, const ShapeList &shapes, float &closest_distance, int &closest_shape ) const {
+#ifdef RT_SIMD
+        if (int entry = store.ClosestHit( r, node.first, node.count, closest_distance ); entry >= 0)
+            closest_shape = prims[entry];
+        // anything that's not a Sphere goes through the Shape itself
+        for (int i = node.first; i < node.first + node.count; i++) {
+            if (store.IsSphere( i ))
+                continue;
+#else
+        for (int i = node.first; i < node.first + node.count; i++) {
+#endif
+            if (float d = Intersection( shapes[prims[i]], r ); d < closest_distance) {
+                closest_distance = d;
+                closest_shape = prims[i];
+            }
+        }
+    }
 
-	return 0;
+    // returns true if ray r intersects any of the Shapes in leaf node closer than max_distance
+    bool OccludedLeaf( const Node &node, const ray &r, const ShapeList &shapes, float max_distance ) const {
+#ifdef RT_SIMD
+        if (store.Occluded( r, node.first, node.count, max_distance ))
+            return true;
+        for (int i = node.first; i < node.first + node.count; i++) {
+            if (store.IsSphere( i ))
+                continue;
+#else
+        for (int i = node.first; i < node.first + node.count; i++) {
+#endif
+            if (Occluded( shapes[prims[i]], r, max_distance ))
+                return true;
+        }
+        return false;
+    }
+
+    // build the (sub)tree over prims [first, first + count) at the given depth, and return the index of its root node
+    int BuildNode( int first, int count, int depth = 0 ) {
+        int node_index = (int)nodes.size();
+        nodes.emplace_back();
+
+        aabb box, centroid_box;
+        for (int i = first; i < first + count; i++) {
+            box.grow( prim_bounds[prims[i]] );
+            centroid_box.grow( prim_bounds[prims[i]].centroid());
+        }
+        nodes[node_index].box = box;
+
+        // find the cheapest split according to the SAH, using binned centroids along each axis
+        float leaf_cost = INTERSECTION_COST * count;
+        float best_cost = INFINITY;
+        int   best_axis = -1, best_bin = 0;
+        vf3d  extent = centroid_box.max - centroid_box.min;
+        for (int axis = 0; axis < 3 && count > 1 && depth < MEDIAN_SPLIT_DEPTH; axis++) {
+            float axis_min    = Axis( centroid_box.min, axis );
+            float axis_extent = Axis( extent, axis );
+            if (axis_extent <= 0.0f)
+                continue;
+
+            aabb bin_box[SAH_BINS];
+            int  bin_count[SAH_BINS] = {};
+            for (int i = first; i < first + count; i++) {
+                int b = BinIndex( Axis( prim_bounds[prims[i]].centroid(), axis ), axis_min, axis_extent );
+                bin_box[b].grow( prim_bounds[prims[i]] );
+                bin_count[b]++;
+            }
+            // sweep from the right to get the area and count right of each split, then from the left to evaluate
+            float right_area[SAH_BINS];
+            int   right_count[SAH_BINS];
+            aabb  right_box;
+            int   right_total = 0;
+            for (int b = SAH_BINS - 1; b > 0; b--) {
+                right_box.grow( bin_box[b] );
+                right_total += bin_count[b];
+                right_area[b]  = right_box.area();
+                right_count[b] = right_total;
+            }
+            aabb left_box;
+            int  left_total = 0;
+            for (int b = 1; b < SAH_BINS; b++) {
+                left_box.grow( bin_box[b - 1] );
+                left_total += bin_count[b - 1];
+                if (left_total == 0 || right_count[b] == 0)
+                    continue;
+                float cost = TRAVERSAL_COST + INTERSECTION_COST * (left_box.area() * left_total + right_area[b] * right_count[b]) / box.area();
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin  = b;
+                }
+            }
+        }
+
+        int left_count = 0;
+        if (best_axis >= 0 && (best_cost < leaf_cost || count > MAX_LEAF_SIZE)) {
+            float axis_min    = Axis( centroid_box.min, best_axis );
+            float axis_extent = Axis( extent, best_axis );
+            auto middle = std::partition( prims.begin() + first, prims.begin() + first + count, [&]( int prim ) {
+                return BinIndex( Axis( prim_bounds[prim].centroid(), best_axis ), axis_min, axis_extent ) < best_bin;
+            } );
+            left_count = int( middle - (prims.begin() + first) );
+        } else if (count > MAX_LEAF_SIZE) {
+            // deep down the tree (or if all centroids coincide, so there's no sensible split position) split in half,
+            // along the axis where the centroids are spread the most
+            int axis = Axis( extent, 0 ) >= Axis( extent, 1 ) ? (Axis( extent, 0 ) >= Axis( extent, 2 ) ? 0 : 2)
+                                                               : (Axis( extent, 1 ) >= Axis( extent, 2 ) ? 1 : 2);
+            left_count = count / 2;
+            std::nth_element( prims.begin() + first, prims.begin() + first + left_count, prims.begin() + first + count, [&]( int a, int b ) {
+                return Axis( prim_bounds[a].centroid(), axis ) < Axis( prim_bounds[b].centroid(), axis );
+            } );
+        }
+
+        if (left_count == 0) {
+            nodes[node_index].first = first;
+            nodes[node_index].count = count;
+        } else {
+            BuildNode( first, left_count, depth + 1 );
+            int right_child = BuildNode( first + left_count, count - left_count, depth + 1 );
+            nodes[node_index].first = right_child;
+            nodes[node_index].count = 0;
+        }
+        return node_index;
+    }
+
+    // SAH cost of the whole tree, relative to the area of the root
+    float Cost() const {
+        if (nodes.empty())
+            return 0.0f;
+        float root_area = std::max( nodes[0].box.area(), 1e-6f );
+        return CostSum() / root_area;
+    }
+    float CostSum() const {
+        float cost = 0.0f;
+        for (const Node &node : nodes)
+            cost += NodeCost( node );
+        return cost;
+    }
+    static float NodeCost( const Node &node ) {
+        return node.box.area() * (node.count > 0 ? INTERSECTION_COST * node.count : TRAVERSAL_COST);
+    }
+
+    // find the parents of the nodes and the leaves of the Shapes, for partial refits
+    void IndexNodes( const ShapeList &shapes ) {
+        parents.assign( nodes.size(), -1 );
+        prim_leaf.assign( shapes.size(), -1 );
+        node_dirty.assign( nodes.size(), false );
+        for (int n = 0; n < (int)nodes.size(); n++) {
+            const Node &node = nodes[n];
+            if (node.count > 0) {
+                for (int i = node.first; i < node.first + node.count; i++)
+                    prim_leaf[prims[i]] = n;
+            } else {
+                parents[n + 1] = n;
+                parents[node.first] = n;
+            }
+        }
+        cost_sum = CostSum();
+    }
+
+    // fill the Sphere store for the current prims
+    void FillStore( const ShapeList &shapes ) {
+#ifdef RT_SIMD
+        // the Sphere store follows the leaf order, so the prims of each leaf are consecutive entries in it
+        store.Resize( (int)prims.size() );
+        for (int i = 0; i < (int)prims.size(); i++)
+            store.Set( i, AsShape( shapes[prims[i]] ));
+#else
+        (void)shapes;
+#endif
+    }
+
+    static float Axis( const vf3d &v, int axis ) {
+        return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+    }
+    static int BinIndex( float value, float axis_min, float axis_extent ) {
+        return std::min( SAH_BINS - 1, int( SAH_BINS * (value - axis_min) / axis_extent ));
+    }
+};
+
+// Game width and height (in pixels) - the default resolution, see RenderSettings
+constexpr int WIDTH   = 400;
+constexpr int HEIGHT  = 400;
+
+constexpr int PIXEL_X =   1;
+constexpr int PIXEL_Y =   1;
+
+// each frame is split up in square tiles of TILE_SIZE x TILE_SIZE pixels, that are rendered in parallel
+constexpr int TILE_SIZE  = 16;
+
+// primary rays are traced in packets of PACKET_SIZE x PACKET_SIZE neighbouring pixels (1 = no packets)
+constexpr int PACKET_SIZE = 2;
+static_assert( TILE_SIZE % PACKET_SIZE == 0, "tiles must consist of whole packets" );
+
+// lighting (the default, see RenderSettings)
+constexpr float AMBIENT_LIGHT = 0.5f;
+
+// colors
+color3 DARK_GREY(  0.5f );
+color3 LIGHT_GREY( 0.8f );
+color3 GREY(       0.7f );
+color3 WHITE(      1.0f );
+
+color3 RED(       1.0f, 0.0f, 0.0f );
+color3 GREEN(     0.0f, 1.0f, 0.0f );
+color3 BLUE(      0.0f, 0.0f, 1.0f );
+color3 YELLOW(    0.0f, 1.0f, 1.0f );
+color3 DARK_BLUE( 0.0f, 0.0f, 0.3f );
+
+// Fog distance and reciprocal (falloff) - the defaults, see RenderSettings
+constexpr float FOG_INTENSITY_INVERSE = 6000.0f;
+constexpr float FOG_INTENSITY = 1.0f / FOG_INTENSITY_INVERSE;
+
+// a color representing scene fog
+color3 FOG = GREY;
+
+
+// the quality presets that can be selected at runtime (with the number keys in the viewer, or --preset)
+// RenderPacket() is specialized for the sample counts of these presets, so their inner loops have constant trip counts
+struct QualityPreset {
+    const char *name;
+    int         samples;
+    int         bounces;
+    float       fog_distance;
+    float       ambient_light;
+};
+constexpr QualityPreset QUALITY_PRESETS[] = {
+    { "draft", 1, 1, FOG_INTENSITY_INVERSE, AMBIENT_LIGHT },
+    { "debug", 2, 2, FOG_INTENSITY_INVERSE, AMBIENT_LIGHT },
+    { "high",  4, 5, FOG_INTENSITY_INVERSE, AMBIENT_LIGHT },
+    { "ultra", 8, 8, FOG_INTENSITY_INVERSE, AMBIENT_LIGHT },
+};
+constexpr int QUALITY_PRESET_COUNT = int( std::size( QUALITY_PRESETS ));
+
+// the preset that is used when nothing else is selected (see RenderSettings::Set())
+constexpr int DEFAULT_PRESET = 1;   // "debug"
+
+constexpr int BOUNCES = QUALITY_PRESETS[DEFAULT_PRESET].bounces;
+constexpr int SAMPLES = QUALITY_PRESETS[DEFAULT_PRESET].samples;
+
+// progressive refinement: while the scene doesn't change, each frame adds PROGRESSIVE_SAMPLES samples per pixel
+// to the ones accumulated over the previous frames. The first frame after a change still takes SAMPLES samples.
+constexpr bool PROGRESSIVE         = true;
+constexpr int  PROGRESSIVE_SAMPLES = 1;
+
+// adaptive sampling: instead of taking the same number of samples for every pixel, each pixel starts with
+// ADAPTIVE_MIN_SAMPLES samples, and the rest of the frame budget goes to the pixels whose samples disagree the most
+// (edges, reflections, shadow boundaries). Pixels whose mean luminance has a standard error below ADAPTIVE_THRESHOLD
+// are converged, and get no extra samples. Static frames (see PROGRESSIVE) get a budget of PROGRESSIVE_SAMPLES per pixel,
+// which is spent on the pixels that aren't converged yet. Adaptive sampling traces every sample on its own (no packets
+// or wavefronts).
+constexpr bool  ADAPTIVE_SAMPLING     = false;
+constexpr int   ADAPTIVE_MIN_SAMPLES  = 2;
+constexpr int   ADAPTIVE_MAX_SAMPLES  = 16;                 // per pixel, per frame
+constexpr int   ADAPTIVE_FRAME_BUDGET = WIDTH * HEIGHT * 3; // total samples in a frame after the scene changed (at WIDTH x HEIGHT)
+constexpr float ADAPTIVE_THRESHOLD    = 0.01f;
+static_assert( ADAPTIVE_MIN_SAMPLES >= 2, "the variance of a pixel needs at least two samples" );
+static_assert( ADAPTIVE_MAX_SAMPLES > 0 && (ADAPTIVE_MAX_SAMPLES & (ADAPTIVE_MAX_SAMPLES - 1)) == 0 && (ADAPTIVE_MAX_SAMPLES & 0x55555555) != 0,
+               "stratified adaptive samples use a square grid of 2^k x 2^k cells per pixel (see Renderer::AdaptiveStratum())" );
+
+// path termination: the weight of a reflection ray is how much the color it finds can add to its pixel at most (the
+// product of the reflectivities and the fog factors along its path, see Renderer::PathWeight() - the lighting isn't
+// part of it, so every trace mode and the GPU kernel cut the same reflections). Reflections with a weight below
+// PATH_WEIGHT_THRESHOLD are hardly visible, so they can be cut short, which makes a high number of bounces affordable
+// for mirror-like Shapes. A reflection that isn't traced is taken to have the color of the surface that reflects it.
+enum class PathTermination {
+    NONE,               // trace all reflections, down to the number of bounces
+    THRESHOLD,          // don't trace reflections with a weight below the threshold (biased: slightly too little reflection)
+    RUSSIAN_ROULETTE    // trace them with a probability of weight / threshold, and then count them 1 / that probability
+                        // times as much, so the image is the same on average (unbiased, but noisier)
+};
+constexpr PathTermination PATH_TERMINATION      = PathTermination::NONE;
+constexpr float           PATH_WEIGHT_THRESHOLD = 0.05f;
+
+// direct lighting: each hit traces LIGHT_SAMPLES shadow rays, however many lights the scene has. Each of them goes to a
+// light that is picked with a probability proportional to its intensity (the light doesn't fall off with distance, so
+// that's how much a light can add anywhere), and for a light with a radius (an area light) to a random point on it,
+// which gives soft shadows. A scene with a single point light is lit exactly with one ray, so it only ever takes one.
+constexpr int LIGHT_SAMPLES = 1;
+
+// shadow cache: the visibility of the light from the primary hits on Shapes that don't move is kept between frames, so
+// only the moving Shapes have to be tested for those hits when the scene animates. The result is only reused for the
+// exact same hit point, which requires the primary rays to repeat: with the cache enabled the sample offsets restart
+// at the same point of their sequence whenever the scene changes (instead of continuing with new ones every frame).
+// Adaptive sampling doesn't use the cache.
+constexpr bool SHADOW_CACHE = false;
+
+// incremental rendering: when the scene changes, only the tiles that may see the change are traced again, the others
+// keep their pixels. A tile is traced again if a moving Shape (at its old or new position) covers part of it on screen,
+// or if the moving Shape overlaps the box around the reflection and shadow rays of the tile's last samples (or some
+// reflection ray of the tile escaped the scene, so it could be hit by anything).
+constexpr bool INCREMENTAL_RENDER = false;
+
+// how the (linear) colors of the image are mapped to 8 bit values, on the screen as well as in the image files:
+// the tone map compresses colors above 1 (which would otherwise be clipped), then DISPLAY_GAMMA is applied (1 keeps the
+// colors linear, like they've always been shown) and the result is clamped to [0, 1]
+enum class ToneMap {
+    CLAMP,       // no tone mapping, just clamp
+    REINHARD     // c / (1 + c)
+};
+constexpr ToneMap TONE_MAP      = ToneMap::CLAMP;
+constexpr float   DISPLAY_GAMMA = 1.0f;
+
+// denoising: the image is filtered with DENOISE_ITERATIONS passes of an edge-aware a-trous wavelet filter before it's
+// shown or written, so a few samples per pixel give a smooth image. The filter is guided by the normal, distance and
+// color (without lighting) of the primary hit at the center of each pixel, which don't have the noise of the lighting,
+// so it blurs across a surface but not across the edges between surfaces. The colors of the pixels are trusted more as
+// they accumulate more samples (see PROGRESSIVE), so the filter fades out while a static image converges.
+// (can be changed at runtime with the denoise setting)
+constexpr bool  DENOISE              = false;
+constexpr int   DENOISE_ITERATIONS   = 3;       // the taps of pass i are 2^i pixels apart
+constexpr float DENOISE_COLOR_SIGMA  = 0.15f;    // luminance difference at which a tap gets 1/e of its weight (at one sample)
+constexpr float DENOISE_DEPTH_SIGMA  = 0.02f;   // the same for the relative difference in distance (per pixel of tap distance)
+constexpr int   DENOISE_NORMAL_POWER = 64;      // the weight for normals at an angle a is cos( a )^DENOISE_NORMAL_POWER
+constexpr float DENOISE_ALBEDO_SIGMA = 0.01f;   // the same as DENOISE_COLOR_SIGMA for the squared difference in color
+static_assert( DENOISE_NORMAL_POWER > 0 && (DENOISE_NORMAL_POWER & (DENOISE_NORMAL_POWER - 1)) == 0,
+               "the normal weight is computed by repeated squaring" );
+
+// temporal reuse: when the scene changes, the pixels don't start over with only the samples of the new frame. Each pixel
+// follows its primary hit back to where that point was in the previous frame (moving it back by the motion of its Shape,
+// the camera doesn't move), and takes the accumulated color of the pixel there as up to TEMPORAL_MAX_HISTORY samples.
+// The history is rejected (disocclusion) when that pixel saw another Shape, or the same Shape at another distance
+// (more than TEMPORAL_DEPTH_TOLERANCE relative), and all of it when the light moves. Shadows and reflections that move
+// over a surface lag behind a little, by at most TEMPORAL_MAX_HISTORY frames.
+constexpr bool  TEMPORAL_REUSE           = false;
+constexpr int   TEMPORAL_MAX_HISTORY     = 4;
+constexpr float TEMPORAL_DEPTH_TOLERANCE = 0.01f;
+
+// frame pipelining: the viewer traces the next frame on a background thread while it draws and presents the current one
+constexpr bool PIPELINE_FRAMES = true;
+
+// frame time budget: the viewer lowers the quality (samples, render resolution, bounces) when its frames take longer
+// than FRAME_TIME_BUDGET seconds, and raises it again when there's enough headroom. A lower render resolution is
+// scaled up to the window with UPSCALE_FILTER.
+enum class UpscaleFilter {
+    NEAREST,    // blocks of pixels, like PIXEL_X x PIXEL_Y
+    BILINEAR
+};
+constexpr bool          FRAME_BUDGET_CONTROL = true;
+constexpr float         FRAME_TIME_BUDGET    = 1.0f / 30.0f;
+constexpr UpscaleFilter UPSCALE_FILTER       = UpscaleFilter::BILINEAR;
+
+// the ways in which the sample offsets within a pixel can be chosen
+enum class SamplePattern {
+    RANDOM,        // independent uniform random offsets
+    STRATIFIED,    // one jittered offset per cell of a (near) square grid over the pixel
+    SOBOL,         // (0,2)-sequence, randomly shifted per pixel and progressing over the frames
+    BLUE_NOISE     // (0,2)-sequence, shifted per pixel by a blue noise mask so the error looks like fine grain
+};
+constexpr SamplePattern SAMPLE_PATTERN = SamplePattern::STRATIFIED;
+
+// the ways in which the rays of a tile can be traced
+enum class TraceMode {
+    RECURSIVE,     // trace each (packet of) primary ray(s) to completion, recursing for each reflection
+    WAVEFRONT      // trace all rays of a tile in bulk one bounce at a time, queueing the reflections for the next bounce
+};
+constexpr TraceMode TRACE_MODE = TraceMode::RECURSIVE;
+
+// stop the closest hit queries at the fog distance: whatever is beyond it only has the color of the fog, just like a
+// miss, so the parts of the BVH out there are never visited - in big open scenes that's most of it. The rays of every
+// bounce start within the fog distance of what they see, so this holds for reflections as well (shadow rays still go
+// all the way to their light, Shapes beyond the fog can cast shadows)
+constexpr bool  FOG_CULLING        = true;
+constexpr float FOG_CULLING_MARGIN = 1.001f;    // the queries look this much further, so that the boxes of the BVH
+                                                // don't cut off hits right at the fog distance through rounding
+
+
+// small and fast pseudo random number generator (PCG32, see https://www.pcg-random.org)
+// it has no global state, so each thread can simply create its own on the stack
+struct pcg32 {
+    uint64_t state = 0;
+    uint64_t inc   = 1;
+
+    // seed the generator - the seed is scrambled first so that neighbouring seeds give unrelated sequences
+    explicit pcg32( uint64_t seed ) {
+        seed = splitmix( seed );
+        inc  = (splitmix( seed ) << 1u) | 1u;
+        next();
+        state += seed;
+        next();
+    }
+
+    // returns a uniformly distributed 32 bit unsigned integer
+    uint32_t next() {
+        uint64_t old_state = state;
+        state = old_state * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = uint32_t(((old_state >> 18u) ^ old_state) >> 27u);
+        uint32_t rot        = uint32_t(old_state >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+
+    // returns a uniformly distributed float in [0, 1)
+    float next_float() {
+        return (next() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // 64 bit mixing function, used to turn structured seeds (like pixel coordinates) into random looking ones
+    static uint64_t splitmix( uint64_t x ) {
+        x += 0x9E3779B97F4A7C15ULL;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+};
+
+// precomputed tables for the SOBOL and BLUE_NOISE sample patterns
+// they are built once (on first use) and only read afterwards, so they can be shared by all threads
+class SampleTables {
+public:
+    static constexpr int SOBOL_SIZE = 256;   // number of points in the (0,2)-sequence table
+    static constexpr int MASK_SIZE  =  32;   // width and height of the (tiling) blue noise masks
+
+    float sobol[SOBOL_SIZE][2];
+    float blue_noise[2][MASK_SIZE * MASK_SIZE];
+
+    static const SampleTables &Get() {
+        static const SampleTables tables;
+        return tables;
+    }
+
+private:
+    SampleTables() {
+        // the first two Sobol dimensions: the van der Corput sequence (bit reversal) and
+        // the dimension generated by the primitive polynomial x + 1
+        for (uint32_t i = 0; i < SOBOL_SIZE; i++) {
+            uint32_t d0 = 0, d1 = 0, v = 1u << 31;
+            for (uint32_t bits = i, k = 0; bits != 0; bits >>= 1, k++, v ^= v >> 1) {
+                if (bits & 1) {
+                    d0 ^= 1u << (31 - k);
+                    d1 ^= v;
+                }
+            }
+            sobol[i][0] = d0 * (1.0f / 4294967296.0f);
+            sobol[i][1] = d1 * (1.0f / 4294967296.0f);
+        }
+        // two independent masks, one for the x and one for the y offset
+        BuildBlueNoise( blue_noise[0], 1 );
+        BuildBlueNoise( blue_noise[1], 2 );
+    }
+
+    // build a tiling blue noise mask with the void-and-cluster method (Ulichney, 1993), with values in [0, 1)
+    static void BuildBlueNoise( float *mask, uint64_t seed ) {
+        constexpr int N = MASK_SIZE * MASK_SIZE;
+        constexpr float SIGMA = 1.5f;
+
+        // gaussian energy contribution as a function of the (toroidal) offset
+        float kernel[MASK_SIZE][MASK_SIZE];
+        for (int dy = 0; dy < MASK_SIZE; dy++) {
+            for (int dx = 0; dx < MASK_SIZE; dx++) {
+                float fx = (float)std::min( dx, MASK_SIZE - dx );
+                float fy = (float)std::min( dy, MASK_SIZE - dy );
+                kernel[dy][dx] = expf( -(fx * fx + fy * fy) / (2.0f * SIGMA * SIGMA) );
+            }
+        }
+        std::vector<bool>  pattern( N, false );
+        std::vector<float> energy( N, 0.0f );
+        auto toggle = [&]( int p, bool set ) {
+            pattern[p] = set;
+            float sign = set ? 1.0f : -1.0f;
+            int px = p % MASK_SIZE, py = p / MASK_SIZE;
+            for (int q = 0; q < N; q++) {
+                int dx = (q % MASK_SIZE - px + MASK_SIZE) % MASK_SIZE;
+                int dy = (q / MASK_SIZE - py + MASK_SIZE) % MASK_SIZE;
+                energy[q] += sign * kernel[dy][dx];
+            }
+        };
+        // tightest cluster = the set pixel with highest energy, largest void = the unset pixel with lowest energy
+        auto tightest_cluster = [&]() {
+            int best = -1;
+            for (int q = 0; q < N; q++)
+                if (pattern[q] && (best < 0 || energy[q] > energy[best])) best = q;
+            return best;
+        };
+        auto largest_void = [&]() {
+            int best = -1;
+            for (int q = 0; q < N; q++)
+                if (!pattern[q] && (best < 0 || energy[q] < energy[best])) best = q;
+            return best;
+        };
+
+        // start with a random initial pattern of 10% set pixels...
+        pcg32 rng( seed );
+        int ones = 0;
+        while (ones < N / 10) {
+            int p = rng.next() % N;
+            if (!pattern[p]) { toggle( p, true ); ones++; }
+        }
+        // ... and move pixels from the tightest clusters to the largest voids until that converges
+        while (true) {
+            int cluster = tightest_cluster();
+            toggle( cluster, false );
+            int gap = largest_void();
+            toggle( gap, true );
+            if (gap == cluster)
+                break;
+        }
+        std::vector<bool>  initial_pattern = pattern;
+        std::vector<float> initial_energy  = energy;
+
+        // rank the initial pixels by removing the tightest clusters one by one...
+        std::vector<int> rank( N, 0 );
+        for (int r = ones - 1; r >= 0; r--) {
+            int cluster = tightest_cluster();
+            toggle( cluster, false );
+            rank[cluster] = r;
+        }
+        // ... and the remaining pixels by filling the largest voids one by one
+        pattern = initial_pattern;
+        energy  = initial_energy;
+        for (int r = ones; r < N; r++) {
+            int gap = largest_void();
+            toggle( gap, true );
+            rank[gap] = r;
+        }
+        for (int q = 0; q < N; q++)
+            mask[q] = (rank[q] + 0.5f) / N;
+    }
+};
+
+
+// a ray in the wavefront renderer, together with the pixel it contributes to
+struct wavefront_path {
+    ray   r;
+    float weight;          // how much the color found along this ray contributes to the pixel
+    float path_weight;     // the weight of this ray for path termination (see Renderer::PathWeight())
+    int   pixel;           // index of the pixel within the tile
+    int   cache_index;     // entry of the shadow cache for the hit of this ray, or -1 if it isn't cached
+};
+
+// a shaded hit in the wavefront renderer, waiting for its shadow ray to be resolved
+struct wavefront_shadow {
+    ray    normal;         // surface normal at the hit
+    color3 color;          // sampled color of the Shape at the hit
+    float  reflectivity;   // clamped reflectivity, or 0 if no reflection ray is spawned
+    ray    incoming;       // the ray that was hit, to create its reflection from (only valid if reflectivity > 0)
+    float  fog;            // clamped fog factor for the distance of the hit
+    float  weight;
+    float  path_weight;
+    int    pixel;
+    int    shape_id;       // the Shape that was hit
+    int    cache_index;
+};
+
+// per pixel running sum of samples over multiple frames, used for progressive refinement of static scenes
+// each pixel is only ever touched by the thread that renders its tile, so no locking is needed
+struct AccumulationBuffer {
+    std::vector<color3> sum;
+    std::vector<float>  luminance_sq;
+    std::vector<int>    count;
+
+    // clear all pixels
+    void Reset( int pixel_count ) {
+        sum.assign( pixel_count, color3( 0.0f ));
+        luminance_sq.assign( pixel_count, 0.0f );
+        count.assign( pixel_count, 0 );
+    }
+    // clear a single pixel
+    void ResetPixel( int pixel ) {
+        sum[pixel] = color3( 0.0f );
+        luminance_sq[pixel] = 0.0f;
+        count[pixel] = 0;
+    }
+
+    // add sample_count samples (with total samples_sum) to a pixel, and return the new average of that pixel
+    // samples_luminance_sq is the sum of the squared luminance of the samples, which is only needed for StandardError()
+    color3 Add( int pixel, const color3 &samples_sum, int sample_count, float samples_luminance_sq = 0.0f ) {
+        sum[pixel] = sum[pixel] + samples_sum;
+        luminance_sq[pixel] += samples_luminance_sq;
+        count[pixel] += sample_count;
+        return Average( pixel );
+    }
+
+    color3 Average( int pixel ) const {
+        return sum[pixel] / (float)count[pixel];
+    }
+
+    // the standard error of the mean luminance of a pixel - an estimate of how far the average is from converged
+    float StandardError( int pixel ) const {
+        if (count[pixel] < 2)
+            return INFINITY;
+        float n        = (float)count[pixel];
+        float mean     = Luminance( sum[pixel] ) / n;
+        float variance = std::max( 0.0f, (luminance_sq[pixel] / n - mean * mean) * n / (n - 1.0f) );
+        return sqrtf( variance / n );
+    }
+
+    static float Luminance( const color3 &c ) {
+        return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+    }
+};
+
+// e^x for x <= 0 (within about 1e-5 relative), with only arithmetic so that loops using it can be vectorized
+inline float FastExp( float x ) {
+    // e^x = 2^(x log2( e )) = 2^whole * 2^fraction, the first goes into the exponent bits, the second is a polynomial
+    float power    = std::max( x, -80.0f ) * 1.44269504f;
+    float whole    = floorf( power );
+    float fraction = power - whole;
+    float result   = 1.0f + fraction * (0.693147182f + fraction * (0.240226507f + fraction * (0.0555041087f
+                          + fraction * (0.00961812911f + fraction * 0.00133335581f))));
+    int32_t bits  = (int32_t( whole ) + 127) << 23;
+    float   scale;
+    memcpy( &scale, &bits, sizeof( scale ));
+    return result * scale;
+}
+#ifdef RT_SIMD
+// the same for 8 values at a time
+inline __m256 FastExp( __m256 x ) {
+    __m256 power    = _mm256_mul_ps( _mm256_max_ps( x, _mm256_set1_ps( -80.0f )), _mm256_set1_ps( 1.44269504f ));
+    __m256 whole    = _mm256_floor_ps( power );
+    __m256 fraction = _mm256_sub_ps( power, whole );
+    __m256 result   = _mm256_set1_ps( 0.00133335581f );
+    for (float coefficient : { 0.00961812911f, 0.0555041087f, 0.240226507f, 0.693147182f, 1.0f })
+        result = _mm256_add_ps( _mm256_mul_ps( result, fraction ), _mm256_set1_ps( coefficient ));
+    __m256i bits = _mm256_slli_epi32( _mm256_add_epi32( _mm256_cvtps_epi32( whole ), _mm256_set1_epi32( 127 )), 23 );
+    return _mm256_mul_ps( result, _mm256_castsi256_ps( bits ));
+}
+#endif // RT_SIMD
+
+// x^N for a power of two N, by squaring
+template <int N>
+inline float PowerOfTwoPower( float x ) {
+    if constexpr (N == 1) {
+        return x;
+    } else {
+        float half = PowerOfTwoPower<N / 2>( x );
+        return half * half;
+    }
+}
+
+// the guides of the denoiser and of temporal reuse: per pixel the normal, distance, color, index and hit point of the
+// Shape that the ray through its center hits first (for a miss, the normal points back along the ray, the distance is
+// that of the fog, and the index is -1)
+struct GuideBuffer {
+    // each component in its own plane, so the denoiser reads consecutive values for consecutive pixels
+    std::array<std::vector<float>, 3> normal;
+    std::vector<float>                depth;
+    std::array<std::vector<float>, 3> albedo;
+    std::vector<int>                  shape;
+    std::vector<vf3d>                 point;
+
+    void Resize( int pixel_count ) {
+        for (int c = 0; c < 3; c++) {
+            normal[c].assign( pixel_count, 0.0f );
+            albedo[c].assign( pixel_count, 0.0f );
+        }
+        depth.assign( pixel_count, 1.0f );
+        shape.assign( pixel_count, -1 );
+        point.assign( pixel_count, vf3d( 0.0f ));
+    }
+
+    void Set( int pixel, const vf3d &_normal, float _depth, const color3 &_albedo, int _shape, const vf3d &_point ) {
+        normal[0][pixel] = _normal.x; normal[1][pixel] = _normal.y; normal[2][pixel] = _normal.z;
+        depth[pixel] = _depth;
+        albedo[0][pixel] = _albedo.x; albedo[1][pixel] = _albedo.y; albedo[2][pixel] = _albedo.z;
+        shape[pixel] = _shape;
+        point[pixel] = _point;
+    }
+};
+
+// the work queues of the wavefront renderer (one set per thread)
+struct WavefrontQueues {
+    std::vector<color3>           pixels;
+    std::vector<wavefront_path>   paths;
+    std::vector<hit_record>       hits;
+    std::vector<wavefront_shadow> shadows;
+};
+
+// persistent pool of worker threads that processes the tiles of a frame
+// each thread owns a contiguous range of tiles, and when that range is exhausted it steals
+// tiles from the ranges of the other threads. Claiming a tile is a single atomic increment,
+// so no locks are needed while a frame is being rendered.
+class TilePool {
+public:
+    // a job is called as job( tile_index, thread_index ) for every tile
+    using Job = std::function<void( int, int )>;
+
+    // the calling thread also works on the tiles, so we spawn one thread less than requested
+    explicit TilePool( int nr_threads = std::max( 1, (int)std::thread::hardware_concurrency())) : ranges( nr_threads ) {
+        for (int i = 1; i < nr_threads; i++)
+            workers.emplace_back( [this, i] { WorkerLoop( i ); } );
+    }
+
+    // signal all workers to stop, and wait until they're finished
+    ~TilePool() {
+        {
+            std::lock_guard<std::mutex> lock( mtx );
+            stopping = true;
+        }
+        start_cv.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    TilePool( const TilePool & ) = delete;
+    TilePool &operator=( const TilePool & ) = delete;
+
+    int ThreadCount() const { return (int)ranges.size(); }
+
+    // process tiles [0, tile_count) and return when all of them are done
+    void Run( int tile_count, const Job &job ) {
+        // hand out an equal share of the tiles to each thread
+        int nr_threads = ThreadCount();
+        for (int i = 0; i < nr_threads; i++) {
+            ranges[i].next.store( (tile_count *  i     ) / nr_threads, std::memory_order_relaxed );
+            ranges[i].end  =      (tile_count * (i + 1)) / nr_threads;
+        }
+        {
+            std::lock_guard<std::mutex> lock( mtx );
+            current_job = &job;
+            busy_workers = (int)workers.size();
+            generation++;
+        }
+        start_cv.notify_all();
+
+        // the calling thread works along as thread 0
+        ProcessTiles( 0, job );
+
+        std::unique_lock<std::mutex> lock( mtx );
+        done_cv.wait( lock, [this] { return busy_workers == 0; } );
+        current_job = nullptr;
+    }
+
+private:
+    // per thread range of tiles - aligned to a cache line to prevent false sharing between threads
+    struct alignas(64) TileRange {
+        std::atomic<int> next{ 0 };
+        int end = 0;
+    };
+
+    std::vector<TileRange>   ranges;
+    std::vector<std::thread> workers;
+
+    std::mutex              mtx;
+    std::condition_variable start_cv, done_cv;
+    const Job *current_job  = nullptr;
+    int        busy_workers = 0;
+    uint64_t   generation   = 0;
+    bool       stopping     = false;
+
+    // try to claim a tile from the range of thread 'owner' - returns -1 if that range is exhausted
+    int Claim( int owner ) {
+        TileRange &range = ranges[owner];
+        if (range.next.load( std::memory_order_relaxed ) >= range.end)
+            return -1;
+        int tile = range.next.fetch_add( 1, std::memory_order_relaxed );
+        return tile < range.end ? tile : -1;
+    }
+
+    // first work through our own range, then steal from the other threads until all ranges are empty
+    void ProcessTiles( int thread_index, const Job &job ) {
+        int nr_threads = ThreadCount();
+        for (int i = 0; i < nr_threads; i++) {
+            int owner = (thread_index + i) % nr_threads;
+            for (int tile = Claim( owner ); tile >= 0; tile = Claim( owner ))
+                job( tile, thread_index );
+        }
+    }
+
+    void WorkerLoop( int thread_index ) {
+        uint64_t seen_generation = 0;
+        while (true) {
+            const Job *job;
+            {
+                std::unique_lock<std::mutex> lock( mtx );
+                start_cv.wait( lock, [&] { return stopping || generation != seen_generation; } );
+                if (stopping)
+                    return;
+                seen_generation = generation;
+                job = current_job;
+            }
+            ProcessTiles( thread_index, *job );
+            {
+                std::lock_guard<std::mutex> lock( mtx );
+                busy_workers -= 1;
+            }
+            done_cv.notify_one();
+        }
+    }
+};
+
+// a thread that runs one job at a time in the background, used by the viewer to trace a frame while the previous
+// one is presented
+class FramePipeline {
+public:
+    FramePipeline() : worker( [this] { WorkerLoop(); } ) {}
+
+    // finish the job that is running, and stop the thread
+    ~FramePipeline() {
+        {
+            std::unique_lock<std::mutex> lock( mtx );
+            done_cv.wait( lock, [this] { return !job; } );
+            stopping = true;
+        }
+        start_cv.notify_one();
+        worker.join();
+    }
+
+    FramePipeline( const FramePipeline & ) = delete;
+    FramePipeline &operator=( const FramePipeline & ) = delete;
+
+    // start running _job, after the previous job is done
+    void Start( std::function<void()> _job ) {
+        {
+            std::unique_lock<std::mutex> lock( mtx );
+            done_cv.wait( lock, [this] { return !job; } );
+            job = std::move( _job );
+        }
+        start_cv.notify_one();
+    }
+
+    // wait until the job that was started last is done
+    void Wait() {
+        std::unique_lock<std::mutex> lock( mtx );
+        done_cv.wait( lock, [this] { return !job; } );
+    }
+
+private:
+    std::mutex              mtx;
+    std::condition_variable start_cv, done_cv;
+    std::function<void()>   job;
+    bool                    stopping = false;
+    std::thread             worker;
+
+    void WorkerLoop() {
+        std::unique_lock<std::mutex> lock( mtx );
+        while (true) {
+            start_cv.wait( lock, [this] { return stopping || job; } );
+            if (stopping)
+                return;
+            // the job runs without the lock, the viewer only touches the renderer again after Wait()
+            lock.unlock();
+            job();
+            lock.lock();
+            job = nullptr;
+            done_cv.notify_all();
+        }
+    }
+};
+
+
+// the runtime settings of the Renderer - the defaults are the compile time constants
+struct RenderSettings {
+    int     width           = WIDTH;
+    int     height          = HEIGHT;
+    int     samples         = SAMPLES;  // samples per pixel (in the first frame after the scene changed, see PROGRESSIVE)
+    int     bounces         = BOUNCES;
+    float   fog_distance    = FOG_INTENSITY_INVERSE;
+    float   ambient_light   = AMBIENT_LIGHT;
+    int64_t adaptive_budget = 0;        // samples per frame for ADAPTIVE_SAMPLING (0 = ADAPTIVE_FRAME_BUDGET, scaled to the resolution)
+    bool    denoise         = DENOISE;
+    bool    gpu             = false;    // render with the GPU backend (see GpuBackend), where it can render the scene. Its
+                                        // samples are always random (whatever SAMPLE_PATTERN is), and without RT_OPENCL,
+                                        // or without an OpenCL device, its kernel runs on the CPU threads instead
+
+    void ApplyPreset( const QualityPreset &preset ) {
+        samples       = preset.samples;
+        bounces       = preset.bounces;
+        fog_distance  = preset.fog_distance;
+        ambient_light = preset.ambient_light;
+    }
+
+    // set a setting by name (as used on the command line and in config files) - returns false if the name is unknown
+    // or the value is invalid
+    bool Set( const std::string &name, const std::string &value ) {
+        char *end;
+        double number = strtod( value.c_str(), &end );
+        bool is_number = !value.empty() && *end == '\0';
+        if (name == "preset") {
+            for (const QualityPreset &preset : QUALITY_PRESETS) {
+                if (value == preset.name) {
+                    ApplyPreset( preset );
+                    return true;
+                }
+            }
+            return false;
+        }
+        // all settings are positive numbers, except for the ambient light which can also be 0, and denoise and gpu which are 0 or 1
+        if (!is_number || !(number >= 0.0) || (number == 0.0 && name != "ambient" && name != "denoise" && name != "gpu"))
+            return false;
+        // the counts and switches are whole numbers that have to fit in their type - this is all checked before a setting
+        // is changed, so a rejected value leaves the settings as they were
+        double largest = name == "budget" ? double( INT64_MAX / 2 ) : name == "denoise" || name == "gpu" ? 1.0 : double( INT_MAX );
+        bool   whole   = name != "fog" && name != "ambient";
+        if (whole && (number != floor( number ) || number > largest))
+            return false;
+        if      (name == "width"  ) width           = int( number );
+        else if (name == "height" ) height          = int( number );
+        else if (name == "samples") samples         = int( number );
+        else if (name == "bounces") bounces         = int( number );
+        else if (name == "fog"    ) fog_distance    = float( number );
+        else if (name == "ambient") ambient_light   = float( number );
+        else if (name == "budget" ) adaptive_budget = int64_t( number );
+        else if (name == "denoise") denoise         = number != 0.0;
+        else if (name == "gpu"    ) gpu             = number != 0.0;
+        else
+            return false;
+        return true;
+    }
+
+    // read settings from a config file, with a "name value" pair per line (and # for comments)
+    // returns false if the file can't be read, or has an invalid line
+    bool Load( const std::string &path ) {
+        FILE *file = fopen( path.c_str(), "r" );
+        if (file == nullptr)
+            return false;
+        bool valid = true;
+        char line[256];
+        while (valid && fgets( line, sizeof( line ), file )) {
+            char name[64], value[128];
+            int fields = sscanf( line, " %63[^# \t\r\n=] %*[=]%127s", name, value );
+            if (fields != 2)
+                fields = sscanf( line, " %63[^# \t\r\n=] %127s", name, value );
+            if (fields == 2)
+                valid = Set( name, value );
+            else
+                valid = sscanf( line, " %1[^# \t\r\n]", name ) != 1;   // only blank lines and comments may remain
+        }
+        fclose( file );
+        return valid;
+    }
+};
+
+// the rendered image: a color per pixel, row by row from the top
+struct Framebuffer {
+    int width  = 0;
+    int height = 0;
+    std::vector<color3> pixels;
+
+    void Resize( int _width, int _height ) {
+        width  = _width;
+        height = _height;
+        pixels.assign( size_t( width ) * height, color3( 0.0f ));
+    }
+
+    color3       &at( int x, int y )       { return pixels[size_t( y ) * width + x]; }
+    const color3 &at( int x, int y ) const { return pixels[size_t( y ) * width + x]; }
+
+    // write the image to a file, in the format that matches the extension of path (.ppm, .png or .pfm)
+    // returns false if the extension is unknown or the file can't be written
+    bool Write( const std::string &path ) const {
+        auto has_extension = [&path]( const char *extension ) {
+            size_t length = strlen( extension );
+            return path.size() >= length && path.compare( path.size() - length, length, extension ) == 0;
+        };
+        if (has_extension( ".ppm" )) return WritePPM( path );
+        if (has_extension( ".png" )) return WritePNG( path );
+        if (has_extension( ".pfm" )) return WritePFM( path );
+        return false;
+    }
+
+    // binary PPM, 8 bits per channel
+    bool WritePPM( const std::string &path ) const {
+        std::vector<uint8_t> rgb = ToRGB8();
+        char header[64];
+        int header_size = snprintf( header, sizeof( header ), "P6\n%d %d\n255\n", width, height );
+        rgb.insert( rgb.begin(), header, header + header_size );
+        return WriteFile( path, rgb );
+    }
+
+    // PNG, 8 bits per channel - the image data goes into uncompressed deflate blocks, so there's no need for zlib
+    bool WritePNG( const std::string &path ) const {
+        std::vector<uint8_t> rgb = ToRGB8();
+        size_t row_size = size_t( width ) * 3;
+
+        // the rows of the image, each preceded by its filter type (0 = none)
+        std::vector<uint8_t> rows;
+        rows.reserve( (row_size + 1) * height );
+        for (int y = 0; y < height; y++) {
+            rows.push_back( 0 );
+            rows.insert( rows.end(), rgb.begin() + y * row_size, rgb.begin() + (y + 1) * row_size );
+        }
+
+        // zlib stream: header, stored blocks of at most 65535 bytes each, and the Adler-32 checksum of the rows
+        std::vector<uint8_t> zlib = { 0x78, 0x01 };
+        size_t position = 0;
+        do {
+            uint16_t length = uint16_t( std::min<size_t>( rows.size() - position, 65535 ));
+            bool     last   = position + length == rows.size();
+            zlib.insert( zlib.end(), { uint8_t( last ), uint8_t( length ), uint8_t( length >> 8 ),
+                                       uint8_t( ~length ), uint8_t( ~length >> 8 ) } );
+            zlib.insert( zlib.end(), rows.begin() + position, rows.begin() + position + length );
+            position += length;
+        } while (position < rows.size());
+        uint32_t a = 1, b = 0;
+        for (uint8_t byte : rows) {
+            a = (a + byte) % 65521;
+            b = (b + a)    % 65521;
+        }
+        AppendBigEndian( zlib, (b << 16) | a );
+
+        std::vector<uint8_t> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+        auto add_chunk = [&png]( const char *type, const std::vector<uint8_t> &data ) {
+            AppendBigEndian( png, uint32_t( data.size()));
+            size_t chunk_start = png.size();
+            png.insert( png.end(), type, type + 4 );
+            png.insert( png.end(), data.begin(), data.end());
+            AppendBigEndian( png, Crc32( png.data() + chunk_start, png.size() - chunk_start ));
+        };
+        std::vector<uint8_t> header;
+        AppendBigEndian( header, uint32_t( width  ));
+        AppendBigEndian( header, uint32_t( height ));
+        header.insert( header.end(), { 8, 2, 0, 0, 0 } );   // 8 bits per channel, RGB, deflate, no filter, no interlacing
+        add_chunk( "IHDR", header );
+        add_chunk( "IDAT", zlib );
+        add_chunk( "IEND", {} );
+        return WriteFile( path, png );
+    }
+
+    // PFM: 32 bit float per channel, without clamping (rows are stored from the bottom up)
+    bool WritePFM( const std::string &path ) const {
+        char header[64];
+        int header_size = snprintf( header, sizeof( header ), "PF\n%d %d\n-1.0\n", width, height );
+        std::vector<uint8_t> data( header, header + header_size );
+        data.reserve( header_size + pixels.size() * 3 * sizeof( float ));
+        for (int y = height - 1; y >= 0; y--) {
+            for (int x = 0; x < width; x++) {
+                const color3 &color = at( x, y );
+                float rgb[3] = { color.x, color.y, color.z };
+                const uint8_t *bytes = reinterpret_cast<const uint8_t *>( rgb );
+                data.insert( data.end(), bytes, bytes + sizeof( rgb ));
+            }
+        }
+        return WriteFile( path, data );
+    }
+
+    // convert the whole image to 8 bit RGBA in one pass, packed as 0xAABBGGRR (the memory layout of olc::Pixel), so it
+    // can be written straight into the pixels of a sprite - out must have room for width * height values
+    void ToRGBA8( uint32_t *out ) const {
+        const color3 *in = pixels.data();
+        size_t count = pixels.size();
+        for (size_t i = 0; i < count; i++) {
+            out[i] = uint32_t( DisplayValue( in[i].x ))         | (uint32_t( DisplayValue( in[i].y )) << 8) |
+                     (uint32_t( DisplayValue( in[i].z )) << 16) | 0xFF000000u;
+        }
+    }
+
+    // map a linear color channel to its 8 bit display value, according to TONE_MAP and DISPLAY_GAMMA
+    // (with the defaults this is the same conversion olc::PixelF() does, but clamped)
+    static uint8_t DisplayValue( float channel ) {
+        if (TONE_MAP == ToneMap::REINHARD)
+            channel = channel / (1.0f + std::max( channel, 0.0f ));
+        if (DISPLAY_GAMMA != 1.0f)
+            channel = powf( std::max( channel, 0.0f ), 1.0f / DISPLAY_GAMMA );
+        return uint8_t( std::clamp( channel, 0.0f, 1.0f ) * 255.0f );
+    }
+
+private:
+    // convert to 8 bit RGB
+    std::vector<uint8_t> ToRGB8() const {
+        std::vector<uint8_t> rgb;
+        rgb.reserve( pixels.size() * 3 );
+        for (const color3 &color : pixels)
+            for (float channel : { color.x, color.y, color.z })
+                rgb.push_back( DisplayValue( channel ));
+        return rgb;
+    }
+
+    static void AppendBigEndian( std::vector<uint8_t> &data, uint32_t value ) {
+        data.insert( data.end(), { uint8_t( value >> 24 ), uint8_t( value >> 16 ), uint8_t( value >> 8 ), uint8_t( value ) } );
+    }
+
+    static uint32_t Crc32( const uint8_t *data, size_t size ) {
+        static const std::array<uint32_t, 256> table = [] {
+            std::array<uint32_t, 256> entries;
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                entries[n] = c;
+            }
+            return entries;
+        }();
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < size; i++)
+            crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    static bool WriteFile( const std::string &path, const std::vector<uint8_t> &data ) {
+        FILE *file = fopen( path.c_str(), "wb" );
+        if (file == nullptr)
+            return false;
+        bool written = fwrite( data.data(), 1, data.size(), file ) == data.size();
+        return fclose( file ) == 0 && written;
+    }
+};
+
+
+// a file that is mapped into memory (read only), so its contents can be used without reading them first
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile() { Close(); }
+
+    MappedFile( const MappedFile & ) = delete;
+    MappedFile &operator=( const MappedFile & ) = delete;
+
+    bool Open( const std::string &path ) {
+        Close();
+#ifdef _WIN32
+        HANDLE file = CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER file_size;
+        HANDLE mapping = nullptr;
+        if (GetFileSizeEx( file, &file_size ) && file_size.QuadPart > 0)
+            mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+        if (mapping != nullptr) {
+            data = static_cast<const uint8_t *>( MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ));
+            size = data ? size_t( file_size.QuadPart ) : 0;
+            CloseHandle( mapping );
+        }
+        CloseHandle( file );
+#else
+        int file = open( path.c_str(), O_RDONLY );
+        if (file < 0)
+            return false;
+        struct stat status;
+        if (fstat( file, &status ) == 0 && status.st_size > 0) {
+            void *mapped = mmap( nullptr, size_t( status.st_size ), PROT_READ, MAP_PRIVATE, file, 0 );
+            if (mapped != MAP_FAILED) {
+                data = static_cast<const uint8_t *>( mapped );
+                size = size_t( status.st_size );
+            }
+        }
+        close( file );
+#endif
+        return data != nullptr;
+    }
+
+    void Close() {
+        if (data != nullptr) {
+#ifdef _WIN32
+            UnmapViewOfFile( data );
+#else
+            munmap( const_cast<uint8_t *>( data ), size );
+#endif
+        }
+        data = nullptr;
+        size = 0;
+    }
+
+    const uint8_t *Data() const { return data; }
+    size_t         Size() const { return size; }
+
+private:
+    const uint8_t *data = nullptr;
+    size_t         size = 0;
+};
+
+// a light: a point light, or with a radius a spherical area light (seen from a point, a disk facing it)
+struct Light {
+    vf3d  position;
+    float radius    = 0.0f;
+    float intensity = 1.0f;     // the light a surface facing it gets (on top of the ambient light)
+};
+
+// the GPU backend (see GpuBackend) traces the same rays and shades them the same way as SampleRay(), for scenes of
+// Spheres and Planes lit by (at most) one point light. Its kernel is written only once, in the part of C that OpenCL C
+// and C++ have in common: RT_GPU_KERNEL() compiles it as C++ (so it can run on the CPU as well, one work item per
+// call, see gpu::work_item) and keeps its text for the OpenCL compiler, which gets the meaning of its own names from
+// KERNEL_PRELUDE. Without recursion in OpenCL C, the reflections are followed in a loop: the color that SampleRay()
+// mixes in at each bounce is added in right away, weighted by how much of it the bounces so far let through.
+#define RT_GPU_KERNEL( ... ) __VA_ARGS__ constexpr const char *KERNEL_SOURCE = #__VA_ARGS__;
+#define RT_KERNEL
+#define RT_GLOBAL
+
+namespace gpu {
+
+typedef uint32_t uint;
+typedef uint64_t ulong;
+using std::sqrt;
+using std::fabs;
+using std::fmod;
+
+inline thread_local size_t work_item = 0;
+inline size_t get_global_id( int ) { return work_item; }
+
+constexpr const char *KERNEL_PRELUDE = "#define RT_KERNEL __kernel\n#define RT_GLOBAL __global\n";
+
+RT_GPU_KERNEL(
+
+// the Shapes are GPU_SHAPE_FLOATS floats each: type (0 = Sphere, 1 = Plane), origin, fill, reflectivity, radius,
+// (Plane) direction and check color. The BVH nodes are two ints each (first, count, see BVH) with six floats for their
+// box, and are traversed with a stack of GPU_STACK_SIZE nodes (as deep as BVH::STACK_SIZE allows). The parameters of a
+// frame are GPU_PARAMETER_COUNT floats.
+enum { GPU_SHAPE_FLOATS = 16, GPU_STACK_SIZE = 64 };
+enum {
+    GPU_WIDTH, GPU_HEIGHT, GPU_SAMPLES, GPU_BOUNCES, GPU_FOG_DISTANCE, GPU_FOG_INTENSITY, GPU_AMBIENT,
+    GPU_LIGHT_X, GPU_LIGHT_Y, GPU_LIGHT_Z, GPU_LIGHT_INTENSITY, GPU_LIGHT_COUNT, GPU_FOG_R, GPU_FOG_G, GPU_FOG_B,
+    GPU_FRAME, GPU_SAMPLES_BEFORE, GPU_NODE_COUNT, GPU_UNBOUNDED_COUNT, GPU_CULL_DISTANCE, GPU_PATH_TERMINATION,
+    GPU_PATH_THRESHOLD, GPU_PARAMETER_COUNT
+};
+
+typedef struct { float x, y, z; } gpu_vec;
+
+gpu_vec gpu_make( float x, float y, float z ) {
+    gpu_vec v;
+    v.x = x;
+    v.y = y;
+    v.z = z;
+    return v;
+}
+gpu_vec gpu_load( RT_GLOBAL const float *p )     { return gpu_make( p[0], p[1], p[2] ); }
+gpu_vec gpu_add( gpu_vec a, gpu_vec b )          { return gpu_make( a.x + b.x, a.y + b.y, a.z + b.z ); }
+gpu_vec gpu_sub( gpu_vec a, gpu_vec b )          { return gpu_make( a.x - b.x, a.y - b.y, a.z - b.z ); }
+gpu_vec gpu_scale( gpu_vec a, float f )          { return gpu_make( a.x * f, a.y * f, a.z * f ); }
+float   gpu_dot( gpu_vec a, gpu_vec b )          { return a.x * b.x + a.y * b.y + a.z * b.z; }
+gpu_vec gpu_normalize( gpu_vec a ) {
+    float length = sqrt( gpu_dot( a, a ));
+    return gpu_make( a.x / length, a.y / length, a.z / length );
+}
+float gpu_saturate( float f ) { return f < 0.0f ? 0.0f : f > 1.0f ? 1.0f : f; }
+
+// PCG32, seeded like pcg32
+typedef struct { ulong state, inc; } gpu_rng;
+
+ulong gpu_splitmix( ulong x ) {
+    x += 0x9E3779B97F4A7C15UL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9UL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBUL;
+    return x ^ (x >> 31);
+}
+uint gpu_next( gpu_rng *rng ) {
+    ulong old_state = rng->state;
+    rng->state = old_state * 6364136223846793005UL + rng->inc;
+    uint xorshifted = (uint)(((old_state >> 18) ^ old_state) >> 27);
+    uint rot        = (uint)(old_state >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31u));
+}
+float gpu_next_float( gpu_rng *rng ) {
+    return (float)(gpu_next( rng ) >> 8) * (1.0f / 16777216.0f);
+}
+gpu_rng gpu_seed( ulong seed ) {
+    gpu_rng rng;
+    seed      = gpu_splitmix( seed );
+    rng.state = 0;
+    rng.inc   = (gpu_splitmix( seed ) << 1) | 1;
+    gpu_next( &rng );
+    rng.state += seed;
+    gpu_next( &rng );
+    return rng;
+}
+
+// the distance along the ray (o, d) where it hits the Shape, or INFINITY (like Sphere::intersection() and Plane::intersection())
+float gpu_intersect( RT_GLOBAL const float *shape, gpu_vec o, gpu_vec d ) {
+    gpu_vec origin = gpu_load( shape + 1 );
+    if (shape[0] == 0.0f) {
+        gpu_vec oc = gpu_sub( o, origin );
+        float a = gpu_dot( d, d );
+        float b = 2.0f * gpu_dot( oc, d );
+        float c = gpu_dot( oc, oc ) - shape[8] * shape[8];
+        float discriminant = b * b - 4.0f * a * c;
+        if (discriminant < 0.0f)
+            return INFINITY;
+        float t = (-b - sqrt( discriminant )) / (2.0f * a);
+        return t < 0.0f ? INFINITY : t;
+    }
+    gpu_vec direction = gpu_load( shape + 9 );
+    float denom = gpu_dot( direction, d );
+    if (fabs( denom ) > 0.001f) {
+        float t = gpu_dot( gpu_sub( origin, o ), direction ) / denom;
+        if (t > 0.0f)
+            return t;
+    }
+    return INFINITY;
+}
+
+// the distance where the ray enters the box of a node, or INFINITY if it misses it within [0, t_max) (like aabb::intersection())
+float gpu_box( RT_GLOBAL const float *box, gpu_vec o, gpu_vec inv, float t_max ) {
+    float tx1 = (box[0] - o.x) * inv.x, tx2 = (box[3] - o.x) * inv.x;
+    float ty1 = (box[1] - o.y) * inv.y, ty2 = (box[4] - o.y) * inv.y;
+    float tz1 = (box[2] - o.z) * inv.z, tz2 = (box[5] - o.z) * inv.z;
+    float t_enter = tx1 < tx2 ? tx1 : tx2, t_exit = tx1 < tx2 ? tx2 : tx1;
+    float ty_enter = ty1 < ty2 ? ty1 : ty2, ty_exit = ty1 < ty2 ? ty2 : ty1;
+    float tz_enter = tz1 < tz2 ? tz1 : tz2, tz_exit = tz1 < tz2 ? tz2 : tz1;
+    t_enter = t_enter > ty_enter ? t_enter : ty_enter;
+    t_enter = t_enter > tz_enter ? t_enter : tz_enter;
+    t_enter = t_enter > 0.0f ? t_enter : 0.0f;
+    t_exit  = t_exit < ty_exit ? t_exit : ty_exit;
+    t_exit  = t_exit < tz_exit ? t_exit : tz_exit;
+    t_exit  = t_exit < t_max ? t_exit : t_max;
+    return t_enter <= t_exit ? t_enter : INFINITY;
+}
+
+// the closest Shape that the ray (o, d) hits closer than t_max, or -1 - with the distance to it in *t (like BVH::ClosestHit())
+int gpu_closest_hit( RT_GLOBAL const float *shapes, RT_GLOBAL const float *boxes, RT_GLOBAL const int *links,
+                     RT_GLOBAL const int *prims, RT_GLOBAL const int *unbounded, int node_count, int unbounded_count,
+                     gpu_vec o, gpu_vec d, float t_max, float *t ) {
+    int closest = -1;
+    float closest_distance = t_max;
+    for (int i = 0; i < unbounded_count; i++) {
+        float distance = gpu_intersect( shapes + GPU_SHAPE_FLOATS * unbounded[i], o, d );
+        if (distance < closest_distance) {
+            closest_distance = distance;
+            closest = unbounded[i];
+        }
+    }
+    gpu_vec inv = gpu_make( 1.0f / d.x, 1.0f / d.y, 1.0f / d.z );
+    int stack[GPU_STACK_SIZE];
+    int stack_size = 0;
+    if (node_count > 0)
+        stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        int n = stack[--stack_size];
+        if (gpu_box( boxes + 6 * n, o, inv, closest_distance ) == INFINITY)
+            continue;
+        int first = links[2 * n], count = links[2 * n + 1];
+        if (count > 0) {
+            for (int i = first; i < first + count; i++) {
+                float distance = gpu_intersect( shapes + GPU_SHAPE_FLOATS * prims[i], o, d );
+                if (distance < closest_distance) {
+                    closest_distance = distance;
+                    closest = prims[i];
+                }
+            }
+        } else {
+            // the nearest child is visited first
+            float t_left  = gpu_box( boxes + 6 * (n + 1), o, inv, closest_distance );
+            float t_right = gpu_box( boxes + 6 * first,   o, inv, closest_distance );
+            stack[stack_size++] = t_left <= t_right ? first : n + 1;
+            stack[stack_size++] = t_left <= t_right ? n + 1 : first;
+        }
+    }
+    *t = closest_distance;
+    return closest;
+}
+
+// whether to trace a reflection with the given weight, like Renderer::PathContinuation() (the path termination is
+// the PathTermination as a number)
+float gpu_continuation( RT_GLOBAL const float *parameters, float weight, gpu_rng *rng ) {
+    float threshold = parameters[GPU_PATH_THRESHOLD];
+    if (parameters[GPU_PATH_TERMINATION] == 0.0f || weight >= threshold)
+        return 1.0f;
+    float survival = weight / threshold;
+    if (parameters[GPU_PATH_TERMINATION] == 2.0f && gpu_next_float( rng ) < survival)
+        return 1.0f / survival;
+    return 0.0f;
+}
+
+// the color of a primary ray, with all its reflections (like Renderer::rtSample())
+gpu_vec gpu_sample( RT_GLOBAL const float *shapes, RT_GLOBAL const float *boxes, RT_GLOBAL const int *links,
+                    RT_GLOBAL const int *prims, RT_GLOBAL const int *unbounded, RT_GLOBAL const float *parameters,
+                    gpu_vec o, gpu_vec d, gpu_rng *rng ) {
+    int     node_count      = (int)parameters[GPU_NODE_COUNT];
+    int     unbounded_count = (int)parameters[GPU_UNBOUNDED_COUNT];
+    float   fog_intensity   = parameters[GPU_FOG_INTENSITY];
+    float   ambient         = parameters[GPU_AMBIENT];
+    gpu_vec fog             = gpu_load( parameters + GPU_FOG_R );
+    gpu_vec light           = gpu_load( parameters + GPU_LIGHT_X );
+
+    gpu_vec color  = gpu_make( 0.0f, 0.0f, 0.0f );
+    float   weight = 1.0f;      // how much of the color of this bounce reaches the pixel
+    float   path_weight = 1.0f; // the weight of this bounce for path termination (see Renderer::PathWeight())
+    for (int bounces = (int)parameters[GPU_BOUNCES]; ; ) {
+        float t;
+        int hit = gpu_closest_hit( shapes, boxes, links, prims, unbounded, node_count, unbounded_count, o, d,
+                                   parameters[GPU_CULL_DISTANCE], &t );
+        // a miss, and anything beyond the fog distance, has the color of the fog
+        if (hit < 0 || t >= parameters[GPU_FOG_DISTANCE]) {
+            color = gpu_add( color, gpu_scale( fog, weight ));
+            break;
+        }
+        bounces -= 1;
+
+        RT_GLOBAL const float *shape = shapes + GPU_SHAPE_FLOATS * hit;
+        gpu_vec origin = gpu_load( shape + 1 );
+        gpu_vec point  = gpu_add( o, gpu_scale( d, t ));
+        gpu_vec normal = shape[0] == 0.0f ? gpu_normalize( gpu_sub( point, origin )) : gpu_load( shape + 9 );
+        gpu_vec fill   = gpu_load( shape + 4 );
+        if (shape[0] != 0.0f) {
+            // the checkerboard of Plane::sample()
+            float u = origin.x - point.x, v = origin.z - point.z;
+            bool checked = (u < 0.0f) != (v < 0.0f);
+            if (fmod( fabs( v ), 100.0f ) < 50.0f) checked = !checked;
+            if (fmod( fabs( u ), 100.0f ) < 50.0f) checked = !checked;
+            if (!checked)
+                fill = gpu_load( shape + 12 );
+        }
+
+        // the point light, unless a Shape is in the way of its light ray (see Renderer::DirectLight())
+        float lighting = ambient;
+        if (parameters[GPU_LIGHT_COUNT] > 0.0f) {
+            gpu_vec to_light = gpu_sub( light, point );
+            float light_distance = sqrt( gpu_dot( to_light, to_light ));
+            gpu_vec light_origin = gpu_add( point, gpu_scale( normal, 0.001f ));
+            gpu_vec light_direction = gpu_normalize( to_light );
+            float blocked;
+            if (gpu_closest_hit( shapes, boxes, links, prims, unbounded, node_count, unbounded_count, light_origin, light_direction,
+                                 light_distance, &blocked ) < 0)
+                lighting = gpu_saturate( ambient + parameters[GPU_LIGHT_INTENSITY] * gpu_dot( light_direction, normal ));
+        }
+
+        // SampleRay() gives lerp( lerp( fill, reflected, reflectivity ) * lighting, fog, fog factor )
+        float reflectivity = bounces != 0 && shape[7] > 0.0f ? gpu_saturate( shape[7] ) : 0.0f;
+        float fog_factor   = fog_intensity != 0.0f ? gpu_saturate( t * fog_intensity ) : 0.0f;
+        // the reflection may not be traced (see PATH_TERMINATION), then the surface color takes its part
+        if (reflectivity > 0.0f) {
+            path_weight = path_weight * reflectivity * (1.0f - fog_factor);
+            float continuation = gpu_continuation( parameters, path_weight, rng );
+            reflectivity *= continuation;
+            path_weight  *= continuation;
+        }
+        color  = gpu_add( color, gpu_add( gpu_scale( fill, weight * (1.0f - reflectivity) * lighting * (1.0f - fog_factor)),
+                                          gpu_scale( fog, weight * fog_factor )));
+        weight = weight * reflectivity * lighting * (1.0f - fog_factor);
+        if (reflectivity <= 0.0f)
+            break;
+
+        // the reflection ray of Renderer::ReflectionRay()
+        o = gpu_add( point, gpu_make( normal.x + 0.001f, normal.y + 0.001f, normal.z + 0.001f ));
+        d = gpu_normalize( gpu_add( gpu_scale( normal, 2.0f * gpu_dot( gpu_scale( d, -1.0f ), normal )), d ));
+    }
+    return color;
+}
+
+// one work item per pixel: take the samples of this frame, add them to those of the previous frames in accumulation,
+// and write the mean of all of them to pixels
+RT_KERNEL void gpu_render( RT_GLOBAL const float *shapes, RT_GLOBAL const float *boxes, RT_GLOBAL const int *links,
+                           RT_GLOBAL const int *prims, RT_GLOBAL const int *unbounded, RT_GLOBAL const float *parameters,
+                           RT_GLOBAL float *accumulation, RT_GLOBAL float *pixels ) {
+    int width = (int)parameters[GPU_WIDTH], height = (int)parameters[GPU_HEIGHT];
+    int pixel = (int)get_global_id( 0 );
+    if (pixel >= width * height)
+        return;
+    int x = pixel % width, y = pixel / width;
+    int samples = (int)parameters[GPU_SAMPLES];
+    gpu_rng rng = gpu_seed( ((ulong)parameters[GPU_FRAME] << 32) | (ulong)pixel );
+
+    gpu_vec sum = gpu_make( 0.0f, 0.0f, 0.0f );
+    for (int i = 0; i < samples; i++) {
+        // a random point in the pixel, and its ray from Renderer::PrimaryRay()
+        float px = (float)x - (float)(width / 2) + gpu_next_float( &rng );
+        float py = (float)y - (float)(height / 2) + gpu_next_float( &rng );
+        gpu_vec d = gpu_normalize( gpu_make( px / (float)height * 100.0f, py / (float)height * 100.0f, 200.0f ));
+        sum = gpu_add( sum, gpu_sample( shapes, boxes, links, prims, unbounded, parameters, gpu_make( 0.0f, 0.0f, -800.0f ), d, &rng ));
+    }
+    float before = parameters[GPU_SAMPLES_BEFORE];
+    RT_GLOBAL float *total = accumulation + 3 * pixel;
+    total[0] = (before > 0.0f ? total[0] : 0.0f) + sum.x;
+    total[1] = (before > 0.0f ? total[1] : 0.0f) + sum.y;
+    total[2] = (before > 0.0f ? total[2] : 0.0f) + sum.z;
+    float scale = 1.0f / (before + (float)samples);
+    pixels[3 * pixel + 0] = total[0] * scale;
+    pixels[3 * pixel + 1] = total[1] * scale;
+    pixels[3 * pixel + 2] = total[2] * scale;
+}
+
+)
+
+} // namespace gpu
+
+static_assert( gpu::GPU_STACK_SIZE >= BVH::STACK_SIZE, "the kernel has to be able to traverse every tree the BVH builds" );
+static_assert( int( PathTermination::NONE ) == 0 && int( PathTermination::RUSSIAN_ROULETTE ) == 2,
+               "the kernel tells the PathTermination by its number (see gpu_continuation())" );
+
+// renders frames with the kernel of the GPU backend (see gpu::gpu_render()): on an OpenCL device when built with RT_OPENCL
+// (and linked with the OpenCL library), or else - and if there is no device - on the threads of the tile pool. The
+// Shapes and the BVH are uploaded as flat arrays when the scene changes, and the samples of the frames in which the
+// scene doesn't change are accumulated on the device; only the mean of each pixel comes back, right into the image.
+class GpuBackend {
+public:
+    GpuBackend() = default;
+    ~GpuBackend() { Release(); }
+
+    GpuBackend( const GpuBackend & ) = delete;
+    GpuBackend &operator=( const GpuBackend & ) = delete;
+
+    // the kernel handles a single point light (or none) - scenes with more lights, or area lights, are rendered on the CPU
+    static bool Supports( const std::vector<Light> &lights ) {
+        return lights.size() <= 1 && (lights.empty() || lights[0].radius <= 0.0f);
+    }
+
+    // whether the frames are rendered on an OpenCL device (rather than on the CPU)
+    bool OnDevice() const {
+#ifdef RT_OPENCL
+        return kernel != nullptr;
+#else
+        return false;
+#endif
+    }
+
+    // take over the Shapes of a scene, with the BVH over them and its light (see Supports())
+    void Upload( const ShapeList &shapes, const BVH &bvh, const std::vector<Light> &lights ) {
+        shape_data.assign( std::max<size_t>( shapes.size(), 1 ) * gpu::GPU_SHAPE_FLOATS, 0.0f );
+        for (size_t i = 0; i < shapes.size(); i++) {
+            float *s = &shape_data[i * gpu::GPU_SHAPE_FLOATS];
+            const Shape &shape = AsShape( shapes[i] );
+            auto put = [&s]( int at, const vf3d &v ) { s[at] = v.x; s[at + 1] = v.y; s[at + 2] = v.z; };
+            put( 1, shape.origin );
+            put( 4, shape.fill );
+            s[7] = shape.reflectivity;
+            if (const Sphere *sphere = dynamic_cast<const Sphere *>( &shape )) {
+                s[8] = sphere->radius;
+            } else {
+                const Plane &plane = dynamic_cast<const Plane &>( shape );
+                s[0] = 1.0f;
+                put( 9, plane.direction );
+                put( 12, plane.check_color );
+            }
+        }
+        bvh.Flatten( boxes, links, prims, unbounded );
+        node_count      = int( links.size() / 2 );
+        unbounded_count = int( unbounded.size());
+        // (OpenCL has no empty buffers)
+        for (std::vector<int> *list : { &links, &prims, &unbounded })
+            if (list->empty())
+                list->push_back( 0 );
+        if (boxes.empty())
+            boxes.assign( 6, 0.0f );
+        light_count = lights.empty() ? 0 : 1;
+        if (!lights.empty())
+            light = lights[0];
+#ifdef RT_OPENCL
+        if (CreateDevice()) {
+            for (cl_mem *buffer : { &shape_buffer, &box_buffer, &link_buffer, &prim_buffer, &unbounded_buffer })
+                ReleaseBuffer( *buffer );
+            shape_buffer     = CreateBuffer( shape_data );
+            box_buffer       = CreateBuffer( boxes );
+            link_buffer      = CreateBuffer( links );
+            prim_buffer      = CreateBuffer( prims );
+            unbounded_buffer = CreateBuffer( unbounded );
+        }
+#endif
+    }
+
+    // render a frame of samples samples per pixel into image, on top of the samples_before samples of the previous frames
+    // (0 to start over) - frame seeds the random generators. Returns false if the OpenCL device failed while it held the
+    // samples of the previous frames: those are lost, so nothing is rendered, and the frame has to start over
+    bool Render( const RenderSettings &settings, uint32_t frame, int samples_before, int samples, Framebuffer &image, TilePool &pool ) {
+        using namespace gpu;
+        parameters.assign( GPU_PARAMETER_COUNT, 0.0f );
+        parameters[GPU_WIDTH]           = float( settings.width );
+        parameters[GPU_HEIGHT]          = float( settings.height );
+        parameters[GPU_SAMPLES]         = float( samples );
+        parameters[GPU_BOUNCES]         = float( settings.bounces );
+        parameters[GPU_FOG_DISTANCE]    = settings.fog_distance;
+        parameters[GPU_FOG_INTENSITY]   = 1.0f / settings.fog_distance;
+        parameters[GPU_AMBIENT]         = settings.ambient_light;
+        parameters[GPU_LIGHT_X]         = light.position.x;
+        parameters[GPU_LIGHT_Y]         = light.position.y;
+        parameters[GPU_LIGHT_Z]         = light.position.z;
+        parameters[GPU_LIGHT_INTENSITY] = light.intensity;
+        parameters[GPU_LIGHT_COUNT]     = float( light_count );
+        parameters[GPU_FOG_R]           = FOG.x;
+        parameters[GPU_FOG_G]           = FOG.y;
+        parameters[GPU_FOG_B]           = FOG.z;
+        parameters[GPU_FRAME]           = float( frame );
+        parameters[GPU_SAMPLES_BEFORE]  = float( samples_before );
+        parameters[GPU_NODE_COUNT]      = float( node_count );
+        parameters[GPU_UNBOUNDED_COUNT] = float( unbounded_count );
+        parameters[GPU_CULL_DISTANCE]   = FOG_CULLING ? settings.fog_distance * FOG_CULLING_MARGIN : INFINITY;
+        parameters[GPU_PATH_TERMINATION] = float( int( PATH_TERMINATION ));
+        parameters[GPU_PATH_THRESHOLD]  = PATH_WEIGHT_THRESHOLD;
+
+        size_t pixel_count = size_t( settings.width ) * settings.height;
+        float *pixels = reinterpret_cast<float *>( image.pixels.data());
+#ifdef RT_OPENCL
+        if (OnDevice()) {
+            if (RenderOnDevice( pixel_count, pixels ))
+                return true;
+            // (RenderOnDevice() released the device, and the samples of the previous frames on it)
+            if (samples_before > 0)
+                return false;
+        }
+#endif
+        accumulation.resize( pixel_count * 3 );
+        pool.Run( settings.height, [&]( int y, int ) {
+            for (int x = 0; x < settings.width; x++) {
+                work_item = size_t( y ) * settings.width + x;
+                gpu_render( shape_data.data(), boxes.data(), links.data(), prims.data(), unbounded.data(), parameters.data(),
+                            accumulation.data(), pixels );
+            }
+        } );
+        return true;
+    }
+
+private:
+    std::vector<float> shape_data, boxes, parameters, accumulation;
+    std::vector<int>   links, prims, unbounded;
+    int                node_count = 0, unbounded_count = 0, light_count = 0;
+    Light              light;
+
+#ifdef RT_OPENCL
+    bool             device_tried = false;
+    cl_context       context = nullptr;
+    cl_command_queue queue   = nullptr;
+    cl_program       program = nullptr;
+    cl_kernel        kernel  = nullptr;
+    cl_mem           shape_buffer = nullptr, box_buffer = nullptr, link_buffer = nullptr, prim_buffer = nullptr, unbounded_buffer = nullptr;
+    cl_mem           parameter_buffer = nullptr, accumulation_buffer = nullptr, pixel_buffer = nullptr;
+    size_t           pixel_buffer_size = 0;
+
+    // set up the first device (preferably a GPU) of the first platform, and build the kernel for it - only tried once
+    bool CreateDevice() {
+        if (device_tried)
+            return kernel != nullptr;
+        device_tried = true;
+        cl_platform_id platform;
+        cl_device_id   device;
+        cl_uint        platform_count = 0;
+        cl_int         error = CL_SUCCESS;
+        if (clGetPlatformIDs( 1, &platform, &platform_count ) != CL_SUCCESS || platform_count == 0 ||
+            (clGetDeviceIDs( platform, CL_DEVICE_TYPE_GPU, 1, &device, nullptr ) != CL_SUCCESS &&
+             clGetDeviceIDs( platform, CL_DEVICE_TYPE_ALL, 1, &device, nullptr ) != CL_SUCCESS)) {
+            fprintf( stderr, "no OpenCL device, the GPU backend runs on the CPU\n" );
+            return false;
+        }
+        context = clCreateContext( nullptr, 1, &device, nullptr, nullptr, &error );
+        if (error == CL_SUCCESS)
+            queue = clCreateCommandQueue( context, device, 0, &error );
+        std::string source = std::string( gpu::KERNEL_PRELUDE ) + gpu::KERNEL_SOURCE;
+        const char *text = source.c_str();
+        if (error == CL_SUCCESS)
+            program = clCreateProgramWithSource( context, 1, &text, nullptr, &error );
+        if (error == CL_SUCCESS && clBuildProgram( program, 1, &device, "", nullptr, nullptr ) != CL_SUCCESS) {
+            size_t log_size = 0;
+            clGetProgramBuildInfo( program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &log_size );
+            std::string log( log_size, '\0' );
+            clGetProgramBuildInfo( program, device, CL_PROGRAM_BUILD_LOG, log_size, log.data(), nullptr );
+            fprintf( stderr, "can't build the GPU kernel:\n%s\n", log.c_str() );
+            error = CL_BUILD_PROGRAM_FAILURE;
+        }
+        if (error == CL_SUCCESS)
+            kernel = clCreateKernel( program, "gpu_render", &error );
+        if (error != CL_SUCCESS) {
+            fprintf( stderr, "can't set up the OpenCL device (error %d), the GPU backend runs on the CPU\n", int( error ));
+            Release();
+        }
+        return kernel != nullptr;
+    }
+
+    template <typename T>
+    cl_mem CreateBuffer( std::vector<T> &data ) {
+        return clCreateBuffer( context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, data.size() * sizeof( T ), data.data(), nullptr );
+    }
+    static void ReleaseBuffer( cl_mem &buffer ) {
+        if (buffer != nullptr)
+            clReleaseMemObject( buffer );
+        buffer = nullptr;
+    }
+
+    // run the kernel over all pixels, and read the result back into pixels - returns false if the device fails
+    bool RenderOnDevice( size_t pixel_count, float *pixels ) {
+        size_t size = pixel_count * 3 * sizeof( float );
+        if (pixel_buffer_size != size) {
+            for (cl_mem *buffer : { &parameter_buffer, &accumulation_buffer, &pixel_buffer })
+                ReleaseBuffer( *buffer );
+            parameter_buffer    = clCreateBuffer( context, CL_MEM_READ_ONLY,  gpu::GPU_PARAMETER_COUNT * sizeof( float ), nullptr, nullptr );
+            accumulation_buffer = clCreateBuffer( context, CL_MEM_READ_WRITE, size, nullptr, nullptr );
+            pixel_buffer        = clCreateBuffer( context, CL_MEM_WRITE_ONLY, size, nullptr, nullptr );
+            pixel_buffer_size   = size;
+        }
+        cl_mem arguments[] = { shape_buffer, box_buffer, link_buffer, prim_buffer, unbounded_buffer, parameter_buffer, accumulation_buffer, pixel_buffer };
+        bool ok = clEnqueueWriteBuffer( queue, parameter_buffer, CL_FALSE, 0, parameters.size() * sizeof( float ), parameters.data(), 0, nullptr, nullptr ) == CL_SUCCESS;
+        for (cl_uint i = 0; ok && i < cl_uint( std::size( arguments )); i++)
+            ok = arguments[i] != nullptr && clSetKernelArg( kernel, i, sizeof( cl_mem ), &arguments[i] ) == CL_SUCCESS;
+        // (the work items beyond the last pixel return right away)
+        size_t local_size = 64, global_size = (pixel_count + local_size - 1) / local_size * local_size;
+        ok = ok && clEnqueueNDRangeKernel( queue, kernel, 1, nullptr, &global_size, &local_size, 0, nullptr, nullptr ) == CL_SUCCESS;
+        ok = ok && clEnqueueReadBuffer( queue, pixel_buffer, CL_TRUE, 0, size, pixels, 0, nullptr, nullptr ) == CL_SUCCESS;
+        if (!ok) {
+            fprintf( stderr, "the OpenCL device failed, the GPU backend runs on the CPU from now on\n" );
+            Release();
+        }
+        return ok;
+    }
+#endif
+
+    void Release() {
+#ifdef RT_OPENCL
+        for (cl_mem *buffer : { &shape_buffer, &box_buffer, &link_buffer, &prim_buffer, &unbounded_buffer,
+                                &parameter_buffer, &accumulation_buffer, &pixel_buffer })
+            ReleaseBuffer( *buffer );
+        pixel_buffer_size = 0;
+        if (kernel  != nullptr) clReleaseKernel( kernel );
+        if (program != nullptr) clReleaseProgram( program );
+        if (queue   != nullptr) clReleaseCommandQueue( queue );
+        if (context != nullptr) clReleaseContext( context );
+        kernel  = nullptr;
+        program = nullptr;
+        queue   = nullptr;
+        context = nullptr;
+#endif
+    }
+};
+
+// binary scene files: a header, blocks of Shapes and lights, and optionally the BVH over those Shapes (see BVH::Write())
+// each block holds a run of consecutive Shapes (or lights) of the same type, with the values of each field of those Shapes stored
+// together (structure of arrays). All values are 4 bytes, in the byte order of the machine, and the header, each block
+// and each of its arrays starts at a multiple of 64 bytes, so the file can be used right where it's mapped.
+struct SceneFileHeader {
+    char     magic[8];          // SCENE_FILE_MAGIC
+    uint32_t version;           // SCENE_FILE_VERSION
+    uint32_t block_count;
+    uint64_t shape_count;
+    uint64_t bvh_offset;        // from the start of the file, 0 if there is no BVH
+    float    light[3];          // the point light of a file without lights blocks (and the first light of one with)
+    uint32_t reserved[5];
+};
+struct SceneFileBlock {
+    uint32_t type;              // SceneBlockType
+    uint32_t count;             // number of Shapes (or lights) in the block
+    uint32_t reserved[14];
+    // followed by the arrays of the fields, each padded to a multiple of 16 values
+};
+static_assert( sizeof( SceneFileHeader ) == 64 && sizeof( SceneFileBlock ) == 64, "scene file headers are a cache line each" );
+
+constexpr char     SCENE_FILE_MAGIC[8] = "RTSCENE";
+constexpr uint32_t SCENE_FILE_VERSION  = 2;    // (version 1 files have no lights blocks, and can still be read)
+enum class SceneBlockType : uint32_t {
+    SPHERES,   // origin x, y, z, radius, fill r, g, b, reflectivity
+    PLANES,    // origin x, y, z, direction x, y, z, fill r, g, b, check color r, g, b, reflectivity
+    LIGHTS     // position x, y, z, radius, intensity
+};
+constexpr int SPHERE_FIELDS = 8;
+constexpr int PLANE_FIELDS  = 13;
+constexpr int LIGHT_FIELDS  = 5;
+// the number of Shapes the writer collects in a block before it's written
+constexpr int SCENE_BLOCK_SIZE = 4096;
+
+// the padded length of each array in a block of count Shapes
+inline size_t SceneBlockStride( uint32_t count ) {
+    return (size_t( count ) + 15) / 16 * 16;
+}
+
+// writes a scene file while the Shapes are added, so it only ever holds one block of them
+class SceneFileWriter {
+public:
+    ~SceneFileWriter() {
+        if (file != nullptr)
+            fclose( file );
+    }
+
+    bool Open( const std::string &path ) {
+        file = fopen( path.c_str(), "wb" );
+        header = SceneFileHeader();
+        memcpy( header.magic, SCENE_FILE_MAGIC, sizeof( header.magic ));
+        header.version = SCENE_FILE_VERSION;
+        // the header is written again when the file is closed, with the final counts
+        return file != nullptr && fwrite( &header, sizeof( header ), 1, file ) == 1;
+    }
+
+    void SetLight( const vf3d &light ) {
+        header.light[0] = light.x;
+        header.light[1] = light.y;
+        header.light[2] = light.z;
+    }
+
+    // add the Shape to the block of its type (a Shape of another type than the previous one starts a new block)
+    bool Add( const Shape &shape ) {
+        if (const Sphere *sphere = dynamic_cast<const Sphere *>( &shape )) {
+            return Append( SceneBlockType::SPHERES, { sphere->origin.x, sphere->origin.y, sphere->origin.z, sphere->radius,
+                                                      sphere->fill.x, sphere->fill.y, sphere->fill.z, sphere->reflectivity } );
+        }
+        const Plane &plane = dynamic_cast<const Plane &>( shape );
+        return Append( SceneBlockType::PLANES, { plane.origin.x, plane.origin.y, plane.origin.z,
+                                                 plane.direction.x, plane.direction.y, plane.direction.z,
+                                                 plane.fill.x, plane.fill.y, plane.fill.z,
+                                                 plane.check_color.x, plane.check_color.y, plane.check_color.z, plane.reflectivity } );
+    }
+
+    // add a light (the first one also goes into the header)
+    bool AddLight( const Light &light ) {
+        if (light_count++ == 0)
+            SetLight( light.position );
+        return Append( SceneBlockType::LIGHTS, { light.position.x, light.position.y, light.position.z, light.radius, light.intensity } );
+    }
+
+    // write the last block and the BVH (if any), and complete the header
+    bool Close( const BVH *bvh = nullptr ) {
+        bool written = Flush();
+        if (written && bvh != nullptr) {
+            header.bvh_offset = uint64_t( ftell( file ));
+            written = bvh->Write( file );
+        }
+        written = written && fseek( file, 0, SEEK_SET ) == 0 && fwrite( &header, sizeof( header ), 1, file ) == 1;
+        written = fclose( file ) == 0 && written;
+        file = nullptr;
+        return written;
+    }
+
+private:
+    FILE                         *file = nullptr;
+    SceneFileHeader               header;
+    SceneBlockType                block_type = SceneBlockType::SPHERES;
+    std::vector<std::vector<float>> fields;    // per field the values of the Shapes in the current block
+    int                           light_count = 0;
+
+    bool Append( SceneBlockType type, std::initializer_list<float> values ) {
+        if (!fields.empty() && (type != block_type || fields[0].size() == SCENE_BLOCK_SIZE) && !Flush())
+            return false;
+        block_type = type;
+        fields.resize( values.size());
+        size_t field = 0;
+        for (float value : values)
+            fields[field++].push_back( value );
+        return true;
+    }
+
+    bool Flush() {
+        if (fields.empty() || fields[0].empty())
+            return true;
+        SceneFileBlock block = SceneFileBlock();
+        block.type  = uint32_t( block_type );
+        block.count = uint32_t( fields[0].size());
+        bool written = fwrite( &block, sizeof( block ), 1, file ) == 1;
+        for (std::vector<float> &values : fields) {
+            values.resize( SceneBlockStride( block.count ), 0.0f );
+            written = written && fwrite( values.data(), sizeof( float ), values.size(), file ) == values.size();
+            values.clear();
+        }
+        header.block_count += 1;
+        if (block_type != SceneBlockType::LIGHTS)
+            header.shape_count += block.count;
+        return written;
+    }
+};
+
+// convert a scene in the text format to a scene file, a line at a time - each line is one of
+//   sphere x y z radius r g b [reflectivity]
+//   plane  x y z nx ny nz r g b check_r check_g check_b [reflectivity]
+//   light  x y z [radius [intensity]]
+// with # starting a comment. Returns false (with a message) if a line can't be read or the file can't be written.
+inline bool ConvertScene( const std::string &text_path, const std::string &scene_path ) {
+    FILE *text = fopen( text_path.c_str(), "r" );
+    if (text == nullptr) {
+        fprintf( stderr, "can't read %s\n", text_path.c_str() );
+        return false;
+    }
+    SceneFileWriter writer;
+    bool ok = writer.Open( scene_path );
+    writer.SetLight( vf3d( 0, -500, -500 ));
+    char line[1024];
+    for (int line_number = 1; ok && fgets( line, sizeof( line ), text ); line_number++) {
+        if (char *comment = strchr( line, '#' ))
+            *comment = '\0';
+        char kind[16];
+        float v[14];
+        int fields = sscanf( line, "%15s %f %f %f %f %f %f %f %f %f %f %f %f %f", kind,
+                             &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9], &v[10], &v[11], &v[12] ) - 1;
+        if (fields < 0)
+            continue;
+        if (strcmp( kind, "sphere" ) == 0 && (fields == SPHERE_FIELDS - 1 || fields == SPHERE_FIELDS)) {
+            ok = writer.Add( Sphere( vf3d( v[0], v[1], v[2] ), color3( v[4], v[5], v[6] ), v[3], fields == SPHERE_FIELDS ? v[7] : 0.0f ));
+        } else if (strcmp( kind, "plane" ) == 0 && (fields == PLANE_FIELDS - 1 || fields == PLANE_FIELDS)) {
+            Plane plane( vf3d( v[0], v[1], v[2] ), vf3d( v[3], v[4], v[5] ), color3( v[6], v[7], v[8] ), color3( v[9], v[10], v[11] ));
+            plane.reflectivity = fields == PLANE_FIELDS ? v[12] : 0.0f;
+            ok = writer.Add( plane );
+        } else if (strcmp( kind, "light" ) == 0 && fields >= 3 && fields <= LIGHT_FIELDS) {
+            ok = writer.AddLight( { vf3d( v[0], v[1], v[2] ), fields > 3 ? v[3] : 0.0f, fields > 4 ? v[4] : 1.0f } );
+        } else {
+            fprintf( stderr, "%s:%d: can't read this line\n", text_path.c_str(), line_number );
+            ok = false;
+        }
+    }
+    fclose( text );
+    if (!writer.Close() || !ok) {
+        fprintf( stderr, "can't convert %s to %s\n", text_path.c_str(), scene_path.c_str() );
+        return false;
+    }
+    return true;
+}
+
+
+// the scenes the Renderer can create: those of step 5 and step 6, and fields of many random Spheres (for benchmarking)
+enum class Scene {
+    STEP5,
+    STEP6,
+    SPHERES_1K,
+    SPHERES_10K,
+    SPHERES_100K,
+    LIGHTS_1K,     // the field of 1000 Spheres, lit by 100 area lights
+    LOADED         // loaded with Renderer::LoadScene(), so it has no name
+};
+constexpr const char *SCENE_NAMES[] = { "step5", "step6", "spheres_1k", "spheres_10k", "spheres_100k", "lights_1k" };
+constexpr int SCENE_COUNT = int( std::size( SCENE_NAMES ));
+
+// the number of rays of each kind that were traced
+struct RayCounts {
+    uint64_t primary    = 0;
+    uint64_t shadow     = 0;
+    uint64_t reflection = 0;
+
+    uint64_t Total() const { return primary + shadow + reflection; }
+
+    RayCounts &operator+= ( const RayCounts &other ) {
+        primary    += other.primary;
+        shadow     += other.shadow;
+        reflection += other.reflection;
+        return *this;
+    }
+    RayCounts operator- ( const RayCounts &other ) const {
+        RayCounts result = *this;
+        result.primary    -= other.primary;
+        result.shadow     -= other.shadow;
+        result.reflection -= other.reflection;
+        return result;
+    }
+};
+
+// the properties of the scene that animation tracks can drive, each a single value
+enum class AnimatedChannel {
+    ORIGIN_X, ORIGIN_Y, ORIGIN_Z,
+    RADIUS,                         // (only for Spheres)
+    FILL_R, FILL_G, FILL_B,
+    LIGHT_X, LIGHT_Y, LIGHT_Z       // of a light, so these tracks have Animation::LightTarget() instead of a Shape
+};
+
+// the animation of a scene: a set of tracks, each of which drives one channel of one Shape (or of a light) as a
+// function of the time. Apply() evaluates all tracks for a point in time and reports which Shapes changed, so the
+// BVH and the incremental renderer only have to deal with those. Since the tracks only depend on the absolute time,
+// rendering frame n of a sequence at time n * step gives the same result however the frames before it were rendered.
+class Animation {
+public:
+    // the target of the tracks that move a light, instead of a Shape index
+    static int LightTarget( int light ) { return -1 - light; }
+
+    // a track that oscillates: base + amplitude * (bias + sin( time / period + phase )), or with cos if cosine is set
+    void AddOscillator( int shape, AnimatedChannel channel, float base, float amplitude, float period = 1.0f,
+                        float phase = 0.0f, float bias = 0.0f, bool cosine = false ) {
+        oscillator_targets.push_back( { shape, channel } );
+        bases.push_back( base );
+        amplitudes.push_back( amplitude );
+        periods.push_back( period );
+        phases.push_back( phase );
+        biases.push_back( bias );
+        cosines.push_back( cosine );
+    }
+
+    // a track that interpolates linearly between keyframes of (time, value), sorted by time - outside of the keys the
+    // track holds the first or last value, or with loop set the keys repeat (from the time of the first one)
+    void AddKeyframes( int shape, AnimatedChannel channel, std::vector<std::pair<float, float>> keys, bool loop = false ) {
+        if (!keys.empty())
+            keyframe_tracks.push_back( { { shape, channel }, std::move( keys ), loop } );
+    }
+
+    void Clear() {
+        *this = Animation();
+    }
+
+    // the indices of the Shapes that have tracks, sorted
+    std::vector<int> Targets() const {
+        std::vector<int> targets;
+        for (const track_target &t : oscillator_targets)
+            if (t.shape >= 0) targets.push_back( t.shape );
+        for (const keyframe_track &track : keyframe_tracks)
+            if (track.target.shape >= 0) targets.push_back( track.target.shape );
+        std::sort( targets.begin(), targets.end());
+        targets.erase( std::unique( targets.begin(), targets.end()), targets.end());
+        return targets;
+    }
+
+    // the Shapes were reordered: Shape i is now Shape new_index[i]
+    void RemapShapes( const std::vector<int> &new_index ) {
+        for (track_target &t : oscillator_targets)
+            if (t.shape >= 0) t.shape = new_index[t.shape];
+        for (keyframe_track &track : keyframe_tracks)
+            if (track.target.shape >= 0) track.target.shape = new_index[track.target.shape];
+    }
+
+    // set all animated channels to their values at time - changed gets the (sorted) indices of the Shapes whose values
+    // changed, and the result is whether a light moved
+    bool Apply( float time, ShapeList &shapes, std::vector<Light> &lights, std::vector<int> &changed ) {
+        // all oscillators are evaluated in one pass over their parameters, then their values are written to the scene
+        size_t count = oscillator_targets.size();
+        values.resize( count + keyframe_tracks.size());
+        for (size_t i = 0; i < count; i++) {
+            float angle = time / periods[i] + phases[i];
+            values[i] = bases[i] + amplitudes[i] * (biases[i] + (cosines[i] ? cosf( angle ) : sinf( angle )));
+        }
+        for (size_t i = 0; i < keyframe_tracks.size(); i++)
+            values[count + i] = keyframe_tracks[i].Evaluate( time );
+
+        changed.clear();
+        bool light_moved = false;
+        for (size_t i = 0; i < values.size(); i++) {
+            const track_target &t = i < count ? oscillator_targets[i] : keyframe_tracks[i - count].target;
+            float *channel = t.shape >= 0 ? ShapeChannel( AsShape( shapes[t.shape] ), t.channel )
+                           : -1 - t.shape < (int)lights.size() ? LightChannel( lights[-1 - t.shape].position, t.channel ) : nullptr;
+            if (channel == nullptr || *channel == values[i])
+                continue;
+            *channel = values[i];
+            if (t.shape < 0)
+                light_moved = true;
+            else
+                changed.push_back( t.shape );
+        }
+        std::sort( changed.begin(), changed.end());
+        changed.erase( std::unique( changed.begin(), changed.end()), changed.end());
+        return light_moved;
+    }
+
+private:
+    struct track_target {
+        int             shape;      // LightTarget() for a light
+        AnimatedChannel channel;
+    };
+
+    // the oscillators, with each parameter in its own array
+    std::vector<track_target> oscillator_targets;
+    std::vector<float>  bases, amplitudes, periods, phases, biases;
+    std::vector<bool>   cosines;
+
+    struct keyframe_track {
+        track_target                        target;
+        std::vector<std::pair<float, float>> keys;
+        bool                                loop;
+
+        float Evaluate( float time ) const {
+            float first = keys.front().first, last = keys.back().first;
+            if (loop && last > first)
+                time = first + fmodf( fmodf( time - first, last - first ) + (last - first), last - first );
+            if (time <= first) return keys.front().second;
+            if (time >= last)  return keys.back().second;
+            auto next = std::upper_bound( keys.begin(), keys.end(), time, []( float t, const std::pair<float, float> &key ) { return t < key.first; } );
+            auto previous = next - 1;
+            float f = (time - previous->first) / (next->first - previous->first);
+            return previous->second + (next->second - previous->second) * f;
+        }
+    };
+    std::vector<keyframe_track> keyframe_tracks;
+
+    // the values of all tracks (oscillators first) at the time of the last Apply()
+    std::vector<float> values;
+
+    static float *ShapeChannel( Shape &shape, AnimatedChannel channel ) {
+        switch (channel) {
+            case AnimatedChannel::ORIGIN_X: return &shape.origin.x;
+            case AnimatedChannel::ORIGIN_Y: return &shape.origin.y;
+            case AnimatedChannel::ORIGIN_Z: return &shape.origin.z;
+            case AnimatedChannel::RADIUS: {
+                Sphere *sphere = dynamic_cast<Sphere *>( &shape );
+                return sphere ? &sphere->radius : nullptr;
+            }
+            case AnimatedChannel::FILL_R: return &shape.fill.x;
+            case AnimatedChannel::FILL_G: return &shape.fill.y;
+            case AnimatedChannel::FILL_B: return &shape.fill.z;
+            default:                      return nullptr;
+        }
+    }
+    static float *LightChannel( vf3d &light, AnimatedChannel channel ) {
+        switch (channel) {
+            case AnimatedChannel::LIGHT_X: return &light.x;
+            case AnimatedChannel::LIGHT_Y: return &light.y;
+            case AnimatedChannel::LIGHT_Z: return &light.z;
+            default:                       return nullptr;
+        }
+    }
+};
+
+// the core of the ray tracer: the scene, the tracing of its rays, and the image they produce
+// it doesn't depend on olc::PixelGameEngine, so it can be driven by the viewer as well as by the command line renderer
+class Renderer {
+public:
+    explicit Renderer( const RenderSettings &_settings = RenderSettings() ) {
+        Configure( _settings );
+    }
+
+    // change the settings - this can be done between any two frames, the next frame starts accumulating anew
+    void Configure( const RenderSettings &_settings ) {
+        settings    = _settings;
+        tiles_x     = (settings.width  + TILE_SIZE - 1) / TILE_SIZE;
+        tiles_y     = (settings.height + TILE_SIZE - 1) / TILE_SIZE;
+        half_width  = settings.width  / 2.0f;
+        half_height = settings.height / 2.0f;
+        fog_intensity = 1.0f / settings.fog_distance;
+        cull_distance = FOG_CULLING ? settings.fog_distance * FOG_CULLING_MARGIN : INFINITY;
+        if (image.width != settings.width || image.height != settings.height)
+            image.Resize( settings.width, settings.height );
+        accumulation.sum.clear();
+        tile_footprints.clear();
+        history_valid = false;
+        gpu_samples = 0;
+        ResetShadowCache();
+    }
+
+    const RenderSettings &Settings()  const { return settings; }
+    // whether the frames are rendered by the GPU backend (it can't denoise, see also GpuBackend::Supports())
+    bool                  RendersOnGpu() const { return settings.gpu && !settings.denoise && GpuBackend::Supports( lights ); }
+    const Framebuffer    &Image()     const { return settings.denoise ? denoised : image; }
+    const ShapeList      &Shapes()    const { return shapes;   }
+    int                   ThreadCount() const { return tile_pool.ThreadCount(); }
+    int                   TileRows()  const { return tiles_y;  }
+
+    // the rays that were traced in the last frame
+    const RayCounts      &FrameRayCounts() const { return frame_ray_counts; }
+#ifdef RT_INSTRUMENT
+    const HotPathCounters &FrameHotPathCounters() const { return frame_hot_counters; }
+#endif
+
+    // fill the scene with its Shapes and light (replacing the current scene)
+    void CreateScene( Scene _scene = Scene::STEP6 ) {
+        ClearScene( _scene );
+
+        switch (scene) {
+            case Scene::STEP5:
+                // the scene of step 5
+                shapes.emplace_back( MakeShape<Sphere>( arena, vf3d(    0,   0,  200 ), GREY,  100.0f, 0.9f ));
+                shapes.emplace_back( MakeShape<Sphere>( arena, vf3d( -150, +75, +300 ), RED,   100.0f, 0.5f ));
+                shapes.emplace_back( MakeShape<Sphere>( arena, vf3d( +150, -75, +100 ), GREEN, 100.0f ));
+                shapes.emplace_back( MakeShape<Plane>( arena, vf3d( 0, 200, 0 ), vf3d( 0, -1, 0 ), LIGHT_GREY, DARK_GREY ));
+                // the first Sphere moves in a circle (sin/cos = easy, cheap motion)
+                animation.AddOscillator( 0, AnimatedChannel::ORIGIN_Y, -100.0f, 100.0f );
+                animation.AddOscillator( 0, AnimatedChannel::ORIGIN_Z,  100.0f, 100.0f, 1.0f, 0.0f, 0.0f, true );
+                break;
+            case Scene::STEP6:
+                // create a new Sphere and add it to our scene
+                shapes.emplace_back( MakeShape<Sphere>( arena, vf3d( 0, 0, 200 ), YELLOW, 100.0f, 0.8f ));
+                // add some additional Spheres at different positions
+                shapes.emplace_back( MakeShape<Sphere>( arena, vf3d( 0, 0, 200 ), RED   , 100.0f, 0.5f ));
+                shapes.emplace_back( MakeShape<Sphere>( arena, vf3d( 0, 0, 200 ), GREEN , 100.0f, 0.2f ));
+                // also add a "floor" Plane
+                shapes.emplace_back( MakeShape<Plane>( arena, vf3d( 0, 300, 0 ), vf3d( 0, -1, 0 ), BLUE, WHITE ));
+                // the red and green Spheres move in circles, the green one three times slower
+                animation.AddOscillator( 1, AnimatedChannel::ORIGIN_X,   0.0f, 200.0f );
+                animation.AddOscillator( 1, AnimatedChannel::ORIGIN_Y,   0.0f, 200.0f, 1.0f, 0.0f, 0.0f, true );
+                animation.AddOscillator( 2, AnimatedChannel::ORIGIN_X,   0.0f, 300.0f, 3.0f );
+                animation.AddOscillator( 2, AnimatedChannel::ORIGIN_Z, 200.0f, 300.0f, 3.0f, 0.0f, 0.0f, true );
+                break;
+            case Scene::SPHERES_1K:
+            case Scene::SPHERES_10K:
+            case Scene::SPHERES_100K:
+            case Scene::LIGHTS_1K: {
+                // randomly sized, colored and placed Spheres above the floor, the same ones every time
+                int count = scene == Scene::SPHERES_10K ? 10000 : scene == Scene::SPHERES_100K ? 100000 : 1000;
+                const color3 palette[] = { RED, GREEN, BLUE, YELLOW, WHITE, GREY, DARK_BLUE };
+                pcg32 rng( (uint64_t)count );
+                for (int i = 0; i < count; i++) {
+                    // (one statement per random number, so they're drawn in the same order by every compiler)
+                    float radius = 10.0f + rng.next_float() * 30.0f;
+                    vf3d  origin;
+                    origin.x = -1500.0f + rng.next_float() * 3000.0f;
+                    origin.y =   300.0f - radius - rng.next_float() * 400.0f;
+                    origin.z =   100.0f + rng.next_float() * 4000.0f;
+                    const color3 &fill = palette[rng.next() % std::size( palette )];
+                    float reflectivity = rng.next_float() * 0.6f;
+                    shapes.emplace_back( MakeShape<Sphere>( arena, origin, fill, radius, reflectivity ));
+                }
+                shapes.emplace_back( MakeShape<Plane>( arena, vf3d( 0, 300, 0 ), vf3d( 0, -1, 0 ), BLUE, WHITE ));
+                // a few of the Spheres move up and down (between 0 and 200 above where they were created)
+                for (int i = 0; i < 16; i++)
+                    animation.AddOscillator( i, AnimatedChannel::ORIGIN_Y, AsShape( shapes[i] ).origin.y, -100.0f, 1.0f, float( i ), 1.0f );
+                if (scene == Scene::LIGHTS_1K) {
+                    // area lights of different sizes and brightness, spread out above the Spheres (they add up to about
+                    // the one light of the other scenes)
+                    for (int i = 0; i < 100; i++) {
+                        Light light;
+                        light.position.x = -2000.0f + rng.next_float() * 4000.0f;
+                        light.position.y =  -200.0f - rng.next_float() * 600.0f;
+                        light.position.z =  -500.0f + rng.next_float() * 5000.0f;
+                        light.radius    = 10.0f + rng.next_float() * 90.0f;
+                        light.intensity = 0.004f + rng.next_float() * 0.016f;
+                        lights.push_back( light );
+                    }
+                }
+            } break;
+            case Scene::LOADED:
+                // (scene files are loaded with LoadScene())
+                break;
+        }
+
+        if (lights.empty())
+            lights.push_back( { vf3d( 0, -500, -500 ) } );
+
+        SortShapes();
+
+        // build the acceleration structure over our scene
+        bvh.Build( shapes );
+        FinishScene();
+    }
+
+    // replace the current scene with the one in a scene file (see SceneFileHeader)
+    // the file is mapped, and each Shape is created right from the arrays in it - if the file has a BVH for the Shapes,
+    // that's used as it is. Returns false (leaving an empty scene) if the file can't be read.
+    bool LoadScene( const std::string &path ) {
+        MappedFile file;
+        if (!file.Open( path ))
+            return LoadScene( nullptr, 0 );
+        return LoadScene( file.Data(), file.Size());
+    }
+
+    // the same for a scene file that is in memory (which must be 4 byte aligned), such as the scene that a worker of a
+    // distributed render receives
+    bool LoadScene( const uint8_t *data, size_t size ) {
+        ClearScene( Scene::LOADED );
+
+        bool valid = data != nullptr && size >= sizeof( SceneFileHeader );
+        SceneFileHeader header;
+        if (valid) {
+            memcpy( &header, data, sizeof( header ));
+            valid = memcmp( header.magic, SCENE_FILE_MAGIC, sizeof( header.magic )) == 0 &&
+                    header.version >= 1 && header.version <= SCENE_FILE_VERSION;
+        }
+        size_t offset = sizeof( SceneFileHeader );
+        for (uint32_t b = 0; valid && b < header.block_count; b++) {
+            SceneFileBlock block;
+            valid = size - offset >= sizeof( block );
+            if (!valid)
+                break;
+            memcpy( &block, data + offset, sizeof( block ));
+            int    field_count = block.type == uint32_t( SceneBlockType::SPHERES ) ? SPHERE_FIELDS :
+                                 block.type == uint32_t( SceneBlockType::PLANES  ) ? PLANE_FIELDS  : LIGHT_FIELDS;
+            size_t stride      = SceneBlockStride( block.count );
+            valid = block.type <= uint32_t( SceneBlockType::LIGHTS ) &&
+                    (size - offset - sizeof( block )) / sizeof( float ) / field_count >= stride;
+            if (!valid)
+                break;
+            // the arrays are 64 byte aligned within the mapped file, so they can be used in place
+            const float *f = reinterpret_cast<const float *>( data + offset + sizeof( block ));
+            for (size_t i = 0; i < block.count; i++) {
+                auto field = [&]( int k ) { return f[k * stride + i]; };
+                if (block.type == uint32_t( SceneBlockType::SPHERES )) {
+                    shapes.emplace_back( MakeShape<Sphere>( arena, vf3d( field( 0 ), field( 1 ), field( 2 )),
+                                                            color3( field( 4 ), field( 5 ), field( 6 )), field( 3 ), field( 7 )));
+                } else if (block.type == uint32_t( SceneBlockType::LIGHTS )) {
+                    lights.push_back( { vf3d( field( 0 ), field( 1 ), field( 2 )), field( 3 ), field( 4 ) } );
+                } else {
+                    shapes.emplace_back( MakeShape<Plane>( arena, vf3d( field( 0 ), field( 1 ), field( 2 )), vf3d( field( 3 ), field( 4 ), field( 5 )),
+                                                           color3( field( 6 ), field( 7 ), field( 8 )), color3( field( 9 ), field( 10 ), field( 11 ))));
+                    AsShape( shapes.back()).reflectivity = field( 12 );
+                }
+            }
+            offset += sizeof( block ) + stride * field_count * sizeof( float );
+        }
+        if (!valid || shapes.size() != header.shape_count) {
+            ClearScene( Scene::LOADED );
+            lights.push_back( { vf3d( 0, -500, -500 ) } );
+            FinishScene();
+            return false;
+        }
+        if (lights.empty())
+            lights.push_back( { vf3d( header.light[0], header.light[1], header.light[2] ) } );
+
+        // the Shapes of a file that comes with its BVH stay in their order, else they're sorted before building one
+        if (header.bvh_offset == 0 || header.bvh_offset >= size ||
+            !bvh.Read( data + header.bvh_offset, size - header.bvh_offset, shapes )) {
+            SortShapes();
+            bvh.Build( shapes );
+        }
+        FinishScene();
+        return true;
+    }
+
+    // write the current scene to a scene file, including its BVH
+    bool SaveScene( const std::string &path ) const {
+        SceneFileWriter writer;
+        bool ok = writer.Open( path );
+        for (size_t i = 0; ok && i < lights.size(); i++)
+            ok = writer.AddLight( lights[i] );
+        for (size_t i = 0; ok && i < shapes.size(); i++)
+            ok = writer.Add( AsShape( shapes[i] ));
+        return writer.Close( &bvh ) && ok;
+    }
+
+private:
+    // remove all Shapes, to start on the given scene
+    void ClearScene( Scene _scene ) {
+        scene = _scene;
+        // the Shapes of the previous scene are all freed at once
+        shapes.clear();
+        arena.Reset();
+        lights.clear();
+        animation.Clear();
+        animated_shapes.clear();
+        moved_bounds.clear();
+        tile_footprints.clear();
+        history_valid = false;
+        gpu_samples = 0;
+        accumulated_time = 0.0f;
+    }
+
+    // set up everything that depends on the Shapes of a new scene, once they're in place and the BVH is built
+    void FinishScene() {
+        animated_shapes = animation.Targets();
+
+        // the lights are picked in proportion to their intensity, with a binary search in the running sum
+        light_cdf.clear();
+        float total = 0.0f;
+        for (const Light &light : lights)
+            light_cdf.push_back( total += std::max( light.intensity, 0.0f ));
+
+        // the shadow cache tests the Shapes that don't move with their own BVH (which never needs a refit)
+        shape_animated.assign( shapes.size(), false );
+        for (int i : animated_shapes)
+            shape_animated[i] = true;
+        if (SHADOW_CACHE)
+            static_bvh.Build( shapes, shape_animated );
+        ResetShadowCache();
+
+        if (TEMPORAL_REUSE) {
+            shape_motion.assign( shapes.size(), vf3d( 0.0f ));
+            history_origins.clear();
+            for (int i : animated_shapes)
+                history_origins.push_back( AsShape( shapes[i] ).origin );
+        }
+    }
+
+public:
+
+    // put the Shapes in Morton order, so the Shapes in a leaf of the BVH are close together in memory as well
+    // they're copied into the spare arena in that order, which then becomes the arena of the scene
+    void SortShapes() {
+        std::vector<int> order = MortonOrder( shapes );
+        std::vector<int> new_index( shapes.size());
+        ShapeList sorted;
+        sorted.reserve( shapes.size());
+        spare_arena.Reset();
+        for (int i : order) {
+            new_index[i] = (int)sorted.size();
+            sorted.push_back( CopyShape( shapes[i], spare_arena ));
+        }
+        shapes = std::move( sorted );
+        arena.Swap( spare_arena );
+        spare_arena.Reset();
+        animation.RemapShapes( new_index );
+    }
+
+    // move the scene along by elapsed_time seconds
+    void Animate( float elapsed_time ) {
+        SetTime( accumulated_time + elapsed_time );
+    }
+
+    // move the animated Shapes (and light) to where they are at time (in seconds)
+    void SetTime( float time ) {
+        RT_ZONE( "Animate" );
+        accumulated_time = time;
+
+        // remember where the moving Shapes were, so the tiles that saw them can be traced again
+        std::vector<std::optional<aabb>> old_bounds;
+        if (INCREMENTAL_RENDER)
+            for (int i : animated_shapes)
+                old_bounds.push_back( AsShape( shapes[i] ).bounds());
+
+        bool light_moved = animation.Apply( time, shapes, lights, changed_shapes );
+
+        // update the bounding boxes in the BVH of just the Shapes that changed
+        if (!changed_shapes.empty())
+            bvh.Refit( shapes, changed_shapes );
+        // with the light in another place all cached light visibility and all tiles are outdated
+        if (light_moved) {
+            ResetShadowCache();
+            moved_bounds.push_back( aabb( vf3d( -INFINITY ), vf3d( INFINITY )));
+            history_valid = false;
+        }
+
+        // the space each changed Shape swept through (approximated by the box around its old and new position)
+        for (size_t i = 0, c = 0; i < old_bounds.size() && c < changed_shapes.size(); i++) {
+            if (animated_shapes[i] != changed_shapes[c])
+                continue;
+            c++;
+            std::optional<aabb> new_bounds = AsShape( shapes[animated_shapes[i]] ).bounds();
+            if (!old_bounds[i] || !new_bounds) {
+                moved_bounds.push_back( aabb( vf3d( -INFINITY ), vf3d( INFINITY )));
+                continue;
+            }
+            aabb box = old_bounds[i].value();
+            box.grow( new_bounds.value());
+            moved_bounds.push_back( box );
+        }
+    }
+
+    // start the frames over as if the scene was just created: the next frames take the same samples as the first ones did
+    // (a worker of a distributed render renders each of its bands from the first frame on)
+    void Rewind() {
+        frame_index        = 0;
+        sequence_start     = 0;
+        frames_since_reset = 0;
+        sequence_at_reset  = 0;
+        accumulation.sum.clear();
+        tile_footprints.clear();
+        history_valid = false;
+        ResetShadowCache();
+    }
+
+    // only render the tiles in the rows [begin, end) of tiles in the next frames (all of them if end < 0) - the pixels of
+    // the other tiles are left as they are
+    void RestrictTileRows( int begin, int end ) {
+        tile_rows_begin = begin;
+        tile_rows_end   = end;
+    }
+
+    // render the current state of the scene into the image
+    void RenderFrame() {
+        RT_ZONE( "RenderFrame" );
+        if (RendersOnGpu()) {
+            RenderFrameGpu();
+            return;
+        }
+        // keep accumulating samples as long as nothing in the scene changed, otherwise start over
+        uint64_t signature = SceneSignature();
+        reset_tiles = !PROGRESSIVE || signature != scene_signature || accumulation.sum.empty();
+        dirty_tiles.clear();
+        if (reset_tiles && INCREMENTAL_RENDER && !accumulation.sum.empty() && (signature == scene_signature || !moved_bounds.empty())
+                        && tile_footprints.size() == size_t( tiles_x * tiles_y )) {
+            // only the tiles that may see the Shapes that moved start over (RenderTile() resets their pixels)
+            std::vector<std::array<int, 4>> moved_rects;
+            for (const aabb &box : moved_bounds)
+                moved_rects.push_back( ScreenBounds( box ));
+            for (int tile = 0; tile < tiles_x * tiles_y; tile++) {
+                int x_start = (tile % tiles_x) * TILE_SIZE, y_start = (tile / tiles_x) * TILE_SIZE;
+                const tile_footprint &footprint = tile_footprints[tile];
+                bool dirty = footprint.unbounded;
+                for (size_t i = 0; i < moved_bounds.size() && !dirty; i++) {
+                    const std::array<int, 4> &rect = moved_rects[i];
+                    dirty = footprint.bounds.overlaps( moved_bounds[i] ) ||
+                            (rect[0] < x_start + TILE_SIZE && x_start <= rect[2] && rect[1] < y_start + TILE_SIZE && y_start <= rect[3]);
+                }
+                if (dirty)
+                    dirty_tiles.push_back( tile );
+            }
+        } else {
+            for (int tile = 0; tile < tiles_x * tiles_y; tile++)
+                dirty_tiles.push_back( tile );
+            if (INCREMENTAL_RENDER && tile_footprints.size() != size_t( tiles_x * tiles_y ))
+                tile_footprints.assign( tiles_x * tiles_y, tile_footprint());
+        }
+        if (tile_rows_end >= 0) {
+            dirty_tiles.erase( std::remove_if( dirty_tiles.begin(), dirty_tiles.end(), [this]( int tile ) {
+                return tile / tiles_x < tile_rows_begin || tile / tiles_x >= tile_rows_end;
+            } ), dirty_tiles.end());
+        }
+        moved_bounds.clear();
+        if (reset_tiles && TEMPORAL_REUSE) {
+            // keep what the previous frame saw, and how far each Shape moved since then
+            reproject = history_valid && guides.depth.size() == size_t( settings.width ) * settings.height;
+            if (reproject) {
+                history = accumulation;
+                history_guides = guides;
+                for (size_t k = 0; k < animated_shapes.size(); k++)
+                    shape_motion[animated_shapes[k]] = AsShape( shapes[animated_shapes[k]] ).origin - history_origins[k];
+            }
+        }
+        if (reset_tiles) {
+            if (accumulation.sum.empty() || !INCREMENTAL_RENDER)
+                accumulation.Reset( settings.width * settings.height );
+            scene_signature = signature;
+            frame_samples = settings.samples;
+            frame_budget  = settings.adaptive_budget > 0 ? settings.adaptive_budget
+                                                         : int64_t( ADAPTIVE_FRAME_BUDGET ) * settings.width * settings.height / (WIDTH * HEIGHT);
+            frames_since_reset = 0;
+            sequence_at_reset  = sequence_start;
+            if ((settings.denoise || TEMPORAL_REUSE) && guides.depth.size() != size_t( settings.width ) * settings.height)
+                guides.Resize( settings.width * settings.height );
+        } else {
+            frame_samples = PROGRESSIVE_SAMPLES;
+            frame_budget  = int64_t( settings.width ) * settings.height * PROGRESSIVE_SAMPLES;
+        }
+
+        render_packet = SelectRenderPacket( std::make_index_sequence<QUALITY_PRESET_COUNT>());
+
+        // spread the tiles of this frame over all the threads of the pool
+        // each thread counts its rays in its own slot, they are added up when the frame is done
+        thread_ray_counts.assign( tile_pool.ThreadCount(), thread_counts() );
+        tile_pool.Run( (int)dirty_tiles.size(), [this]( int dirty_index, int thread_index ) {
+            int tile_index = dirty_tiles[dirty_index];
+            RayCounts before = ThreadRayCounts();
+            // a tile that starts over only needs to remember the rays of its new samples
+            if (INCREMENTAL_RENDER)
+                ThreadFootprint() = reset_tiles ? tile_footprint() : tile_footprints[tile_index];
+#ifdef RT_INSTRUMENT
+            HotPathCounters hot_before = ThreadHotPathCounters();
+            {
+                RT_TIME( tile_ns );
+                RenderTile( tile_index );
+            }
+            thread_ray_counts[thread_index].hot += ThreadHotPathCounters() - hot_before;
+#else
+            RenderTile( tile_index );
+#endif
+            thread_ray_counts[thread_index].counts += ThreadRayCounts() - before;
+            if (INCREMENTAL_RENDER)
+                tile_footprints[tile_index] = ThreadFootprint();
+        } );
+        frame_ray_counts = RayCounts();
+        for (const thread_counts &counts : thread_ray_counts)
+            frame_ray_counts += counts.counts;
+#ifdef RT_INSTRUMENT
+        frame_hot_counters = HotPathCounters();
+        for (const thread_counts &counts : thread_ray_counts)
+            frame_hot_counters += counts.hot;
+#endif
+        if (settings.denoise)
+            Denoise();
+        if (TEMPORAL_REUSE) {
+            for (size_t k = 0; k < animated_shapes.size(); k++)
+                history_origins[k] = AsShape( shapes[animated_shapes[k]] ).origin;
+            history_valid = true;
+        }
+        frame_index++;
+        frames_since_reset++;
+        // (an adaptive pixel can take up to ADAPTIVE_MAX_SAMPLES samples in a frame)
+        sequence_start += ADAPTIVE_SAMPLING ? ADAPTIVE_MAX_SAMPLES : frame_samples;
+    }
+
+    // render the frame with the GPU backend - like RenderFrame(), it accumulates the samples of the frames in which the
+    // scene doesn't change. The rays aren't counted.
+    void RenderFrameGpu() {
+        RT_ZONE( "RenderFrameGpu" );
+        uint64_t signature = SceneSignature();
+        if (!PROGRESSIVE || signature != gpu_signature || gpu_samples == 0) {
+            gpu.Upload( shapes, bvh, lights );
+            gpu_signature = signature;
+            gpu_samples   = 0;
+        }
+        int samples = gpu_samples == 0 ? settings.samples : PROGRESSIVE_SAMPLES;
+        if (!gpu.Render( settings, frame_index, gpu_samples, samples, image, tile_pool )) {
+            // the device failed, and the samples accumulated on it with it: start over on the CPU
+            gpu_samples = 0;
+            samples     = settings.samples;
+            gpu.Render( settings, frame_index, gpu_samples, samples, image, tile_pool );
+        }
+        gpu_samples += samples;
+        frame_ray_counts = RayCounts();
+#ifdef RT_INSTRUMENT
+        frame_hot_counters = HotPathCounters();
+#endif
+        // if the CPU takes over again (say, to denoise), it starts over
+        accumulation.sum.clear();
+        frame_index++;
+    }
+
+    // render all pixels of the tile with index tile_index
+    // the tiles don't overlap, so each thread writes to its own pixels of the image and no locking is required
+    void RenderTile( int tile_index ) {
+        RT_ZONE( "RenderTile" );
+        int x_start = (tile_index % tiles_x) * TILE_SIZE;
+        int y_start = (tile_index / tiles_x) * TILE_SIZE;
+        int x_end   = std::min( x_start + TILE_SIZE, settings.width  );
+        int y_end   = std::min( y_start + TILE_SIZE, settings.height );
+        // (a stream of its own, so it doesn't repeat the random numbers of the pixels)
+        ThreadShadingRng() = pcg32( (uint64_t( SampleSeed()) << 32) ^ (uint64_t( tile_index ) | (uint64_t( 1 ) << 31)));
+
+        // with incremental rendering the accumulation buffer isn't cleared as a whole, each tile that starts over clears its own pixels
+        if (INCREMENTAL_RENDER && reset_tiles)
+            for (int y = y_start; y < y_end; y++)
+                for (int x = x_start; x < x_end; x++)
+                    accumulation.ResetPixel( y * settings.width + x );
+        // the guides only change when the tile starts over
+        if ((settings.denoise || TEMPORAL_REUSE) && reset_tiles)
+            RenderGuides( x_start, y_start, x_end, y_end );
+        if (TEMPORAL_REUSE && reset_tiles && reproject)
+            ReprojectHistory( x_start, y_start, x_end, y_end );
+
+        if (ADAPTIVE_SAMPLING) {
+            RenderTileAdaptive( x_start, y_start, x_end, y_end );
+            return;
+        }
+        if (TRACE_MODE == TraceMode::WAVEFRONT) {
+            RenderTileWavefront( x_start, y_start, x_end, y_end );
+            return;
+        }
+
+		// Iterate over the rows and columns of the tile, a packet at a time
+        for (int y = y_start; y < y_end; y += PACKET_SIZE) {
+		    for (int x = x_start; x < x_end; x += PACKET_SIZE) {
+                (this->*render_packet)( x, y, x_end, y_end );
+		    }
+        }
+    }
+
+    // pick the specialization of RenderPacket() for the sample count of this frame, or the generic one if there is none
+    // the specializations are those for the sample counts of the presets, and for the frames that accumulate
+    using PacketRenderer = void (Renderer::*)( int, int, int, int );
+    template <size_t... PRESET>
+    PacketRenderer SelectRenderPacket( std::index_sequence<PRESET...> ) const {
+        if (frame_samples == PROGRESSIVE_SAMPLES)
+            return &Renderer::RenderPacket<PROGRESSIVE_SAMPLES>;
+        PacketRenderer result = &Renderer::RenderPacket<0>;
+        ((frame_samples == QUALITY_PRESETS[PRESET].samples ? (void)(result = &Renderer::RenderPacket<QUALITY_PRESETS[PRESET].samples>) : (void)0), ...);
+        return result;
+    }
+
+    // render the PACKET_SIZE x PACKET_SIZE pixels with top left pixel (x_start, y_start), clipped to (x_end, y_end)
+    // FIXED_SAMPLES is the number of samples per pixel if it is known at compile time, or 0 to use frame_samples
+    template <int FIXED_SAMPLES>
+    void RenderPacket( int x_start, int y_start, int x_end, int y_end ) {
+        constexpr int N = PACKET_SIZE * PACKET_SIZE;
+        const int sample_count = FIXED_SAMPLES > 0 ? FIXED_SAMPLES : frame_samples;
+
+        // for each pixel of the packet, create rays for all of its samples
+        // we'll be sampling each pixel multiple times when varying offsets to create a multisample,
+        // and then rendering the average of these samples.
+        // with a fixed sample count the buffers are on the stack, otherwise they are kept per thread (so their
+        // memory is reused between packets)
+        struct ray_packet { ray rays[N]; };
+        ray_packet fixed_packets[std::max( FIXED_SAMPLES, 1 )];
+        color3     fixed_samples[std::max( FIXED_SAMPLES, 1 ) * N];
+        ray_packet *packets = fixed_packets;
+        color3     *samples = fixed_samples;
+        if constexpr (FIXED_SAMPLES == 0) {
+            static thread_local std::vector<ray_packet> dynamic_packets;
+            static thread_local std::vector<color3>     dynamic_samples;
+            dynamic_packets.resize( sample_count );
+            dynamic_samples.resize( size_t( sample_count ) * N );
+            packets = dynamic_packets.data();
+            samples = dynamic_samples.data();
+        }
+        for (int k = 0; k < N; k++) {
+            // pixels that fall outside the clip area are traced along with the others, but never drawn
+            int x = std::min( x_start + k % PACKET_SIZE, x_end - 1 );
+            int y = std::min( y_start + k / PACKET_SIZE, y_end - 1 );
+
+            // each pixel gets its own random generator, seeded by its position and the frame number (see SampleSeed()),
+            // so the result doesn't depend on which thread renders it, and frames are reproducible
+            pcg32 rng( (uint64_t( SampleSeed()) << 32) | uint64_t( y * settings.width + x ) );
+
+            for (int i = 0; i < sample_count; i++) {
+                // create an offset within this pixel, and a ray through that offset
+                float offsetX, offsetY;
+                PixelOffset( x, y, i, sample_count, rng, offsetX, offsetY );
+                packets[i].rays[k] = PrimaryRay( x - half_width + offsetX, y - half_height + offsetY );
+            }
+        }
+
+        // sample the color for each ray - the samples of pixel k are at [k * sample_count, (k + 1) * sample_count)
+        for (int i = 0; i < sample_count; i++) {
+            if constexpr (N == 1) {
+                samples[i] = SampleRay( packets[i].rays[0], settings.bounces, ShadowCacheIndex( x_start, y_start, i )).value_or( FOG );
+            } else {
+                // find the primary hits for the whole packet at once, and shade them one by one
+                hit_record hits[N];
+                {
+                    RT_TIME( intersection_ns );
+                    bvh.ClosestHitPacket( packets[i].rays, shapes, hits, cull_distance );
+                }
+                for (int k = 0; k < N; k++) {
+                    int x = std::min( x_start + k % PACKET_SIZE, x_end - 1 );
+                    int y = std::min( y_start + k / PACKET_SIZE, y_end - 1 );
+                    samples[k * sample_count + i] = ShadeHit( packets[i].rays[k], hits[k], settings.bounces,
+                                                              ShadowCacheIndex( x, y, i )).value_or( FOG );
+                }
+            }
+        }
+
+        // add the samples to the accumulated ones, and draw the resulting average color per pixel
+        for (int k = 0; k < N; k++) {
+            int x = x_start + k % PACKET_SIZE;
+            int y = y_start + k / PACKET_SIZE;
+            if (x >= x_end || y >= y_end)
+                continue;
+            const color3 *first = samples + k * sample_count;
+            color3 sum = std::accumulate( first, first + sample_count, color3( 0.0f ));
+            image.at( x, y ) = accumulation.Add( y * settings.width + x, sum, sample_count );
+        }
+    }
+
+    // render the pixels [x_start, x_end) x [y_start, y_end) with adaptive sampling: pixels that haven't been sampled since
+    // the scene changed first get ADAPTIVE_MIN_SAMPLES samples, then this tile's share of the frame budget is divided
+    // over the pixels that aren't converged, in proportion to their standard error
+    void RenderTileAdaptive( int x_start, int y_start, int x_end, int y_end ) {
+        int tile_width  = x_end - x_start;
+        int pixel_count = tile_width * (y_end - y_start);
+        int budget      = int( frame_budget * pixel_count / (int64_t( settings.width ) * settings.height ));
+
+        // takes sample_count samples for a pixel, continuing at sample number first_sample of this frame
+        auto sample_pixel = [this]( int x, int y, int first_sample, int sample_count, pcg32 &rng ) {
+            color3 sum( 0.0f );
+            float  luminance_sq = 0.0f;
+            int    accumulated  = accumulation.count[y * settings.width + x];
+            for (int i = first_sample; i < first_sample + sample_count; i++) {
+                // the passes over a pixel don't know how many samples it gets in the end, so stratified samples go
+                // into the cells of a fixed grid, in an order that spreads out any number of them - continuing over
+                // the frames with the samples the pixel already has
+                float offsetX, offsetY;
+                if (SAMPLE_PATTERN == SamplePattern::STRATIFIED)
+                    PixelOffset( x, y, AdaptiveStratum( (accumulated + i - first_sample) % ADAPTIVE_MAX_SAMPLES ), ADAPTIVE_MAX_SAMPLES,
+                                 rng, offsetX, offsetY );
+                else
+                    PixelOffset( x, y, i, first_sample + sample_count, rng, offsetX, offsetY );
+                color3 sample = rtSample( x - half_width + offsetX, y - half_height + offsetY );
+                sum = sum + sample;
+                luminance_sq += AccumulationBuffer::Luminance( sample ) * AccumulationBuffer::Luminance( sample );
+            }
+            accumulation.Add( y * settings.width + x, sum, sample_count, luminance_sq );
+        };
+
+        // the per pixel random generators and sample counts of this frame (kept per thread, so they are reused)
+        thread_local std::vector<pcg32> rngs;
+        thread_local std::vector<int>   taken;
+        thread_local std::vector<float> errors;
+        thread_local std::vector<float> weights;
+        rngs.clear();
+        taken.assign( pixel_count, 0 );
+        errors.assign( pixel_count, 0.0f );
+        weights.assign( pixel_count, 0.0f );
+
+        // first pass: make sure every pixel has enough samples to estimate its variance
+        for (int p = 0; p < pixel_count; p++) {
+            int x = x_start + p % tile_width;
+            int y = y_start + p / tile_width;
+            rngs.emplace_back( (uint64_t( SampleSeed()) << 32) | uint64_t( y * settings.width + x ) );
+            int missing = ADAPTIVE_MIN_SAMPLES - accumulation.count[y * settings.width + x];
+            if (missing > 0) {
+                sample_pixel( x, y, 0, missing, rngs[p] );
+                taken[p] = missing;
+                budget  -= missing;
+            }
+            errors[p] = accumulation.StandardError( y * settings.width + x );
+        }
+
+        // a few samples that happen to agree don't prove a pixel is converged, so each pixel takes the largest error
+        // of its neighbours: this way an edge that is detected in one pixel gets refined along its whole length
+        float total_error = 0.0f;
+        for (int p = 0; p < pixel_count; p++) {
+            int px = p % tile_width;
+            int py = p / tile_width;
+            float error = 0.0f;
+            for (int ny = std::max( py - 1, 0 ); ny <= std::min( py + 1, y_end - y_start - 1 ); ny++)
+                for (int nx = std::max( px - 1, 0 ); nx <= std::min( px + 1, tile_width - 1 ); nx++)
+                    error = std::max( error, errors[ny * tile_width + nx] );
+            weights[p] = error >= ADAPTIVE_THRESHOLD ? error : 0.0f;
+            total_error += weights[p];
+        }
+
+        // second pass: hand out the remaining budget, carrying the rounding remainder over to the next pixel
+        float carry = 0.0f;
+        for (int p = 0; p < pixel_count && budget > 0 && total_error > 0.0f; p++) {
+            if (weights[p] == 0.0f)
+                continue;
+            carry += budget * (weights[p] / total_error);
+            int extra = std::min( int( carry ), ADAPTIVE_MAX_SAMPLES - taken[p] );
+            carry -= int( carry );
+            if (extra > 0)
+                sample_pixel( x_start + p % tile_width, y_start + p / tile_width, taken[p], extra, rngs[p] );
+        }
+
+        for (int p = 0; p < pixel_count; p++) {
+            int x = x_start + p % tile_width;
+            int y = y_start + p / tile_width;
+            image.at( x, y ) = accumulation.Average( y * settings.width + x );
+        }
+    }
+
+    // render the pixels [x_start, x_end) x [y_start, y_end) breadth first: all primary rays are generated into a queue,
+    // which is intersected in bulk. The hits are shaded, and their shadow rays are collected and resolved in bulk as well.
+    // The reflection rays that this spawns form the queue for the next bounce, until the queue drains or BOUNCES is reached.
+    // Since the shading of SampleRay() is linear in the reflected color, each path just carries the weight with which its
+    // color contributes to its pixel, and there is no recursion (so no stack depth limit on the number of bounces).
+    void RenderTileWavefront( int x_start, int y_start, int x_end, int y_end ) {
+        // the queues are kept per thread, so their memory is reused between tiles and frames
+        static thread_local WavefrontQueues wave;
+        int tile_width = x_end - x_start;
+        int pixel_count = tile_width * (y_end - y_start);
+        wave.pixels.assign( pixel_count, color3( 0.0f ));
+        wave.paths.clear();
+
+        // generate the primary rays - the pixels collect the sum of their samples
+        for (int p = 0; p < pixel_count; p++) {
+            int x = x_start + p % tile_width;
+            int y = y_start + p / tile_width;
+            pcg32 rng( (uint64_t( SampleSeed()) << 32) | uint64_t( y * settings.width + x ) );
+            for (int i = 0; i < frame_samples; i++) {
+                float offsetX, offsetY;
+                PixelOffset( x, y, i, frame_samples, rng, offsetX, offsetY );
+                wave.paths.push_back( { PrimaryRay( x - half_width + offsetX, y - half_height + offsetY ), 1.0f, 1.0f, p,
+                                        ShadowCacheIndex( x, y, i ) } );
+            }
+        }
+
+        for (int bounce = 0; bounce < settings.bounces && !wave.paths.empty(); bounce++) {
+            bool spawn_reflections = bounce + 1 < settings.bounces;
+
+            // intersect all rays of this bounce
+            wave.hits.resize( wave.paths.size());
+            {
+                RT_TIME( intersection_ns );
+                for (size_t i = 0; i < wave.paths.size(); i++)
+                    wave.hits[i] = bvh.ClosestHit( wave.paths[i].r, shapes, cull_distance );
+            }
+
+            // shade all hits, and queue their shadow rays
+            wave.shadows.clear();
+            for (size_t i = 0; i < wave.paths.size(); i++) {
+                const wavefront_path &path = wave.paths[i];
+                hit_record &hit = wave.hits[i];
+                // a miss, or a hit beyond the furthest Fog point, just results in the Fog color
+                if (hit.shape_id < 0 || hit.t >= settings.fog_distance) {
+                    if (hit.shape_id < 0)
+                        RT_COUNT( misses );
+                    else
+                        RT_COUNT( fog_early_outs );
+                    if (bounce > 0)
+                        AddToFootprint( path.r, hit.shape_id < 0 ? cull_distance : hit.t );
+                    wave.pixels[path.pixel] = wave.pixels[path.pixel] + FOG * path.weight;
+                    continue;
+                }
+                const ShapeStorage &intersected_storage = shapes[hit.shape_id];
+                const Shape &intersected_shape = AsShape( intersected_storage );
+
+                hit.point = (path.r * hit.t).end();
+                VisitShape( intersected_storage, [&]( const auto &shape ) { shape.surface( hit ); } );
+
+                wavefront_shadow shadow;
+                shadow.normal = ray( hit.point, hit.normal );
+                if (bounce > 0)
+                    AddToFootprint( path.r, hit.t );
+                shadow.color = VisitShape( intersected_storage, [&]( const auto &shape ) { return shape.sample( hit ); } );
+                shadow.reflectivity = 0.0f;
+                if (spawn_reflections && intersected_shape.reflectivity > 0.0f) {
+                    // lerp() saturates, so the reflectivity is clamped to [0, 1] as well
+                    shadow.reflectivity = std::min( intersected_shape.reflectivity, 1.0f );
+                    shadow.incoming = path.r;
+                }
+                shadow.fog = fog_intensity ? std::clamp( hit.t * fog_intensity, 0.0f, 1.0f ) : 0.0f;
+                shadow.weight = path.weight;
+                shadow.path_weight = path.path_weight;
+                shadow.pixel = path.pixel;
+                shadow.shape_id = hit.shape_id;
+                shadow.cache_index = path.cache_index;
+                wave.shadows.push_back( shadow );
+            }
+
+            // trace the shadow rays of all hits, accumulate the color of each hit, and queue the reflections for the next bounce
+            //   color = lerp( lerp( sample, reflected, reflectivity ) * light, FOG, fog )
+            //         = (1 - fog) * light * (1 - reflectivity) * sample + fog * FOG  +  (1 - fog) * light * reflectivity * reflected
+            wave.paths.clear();
+            for (const wavefront_shadow &shadow : wave.shadows) {
+                float light = DirectLight( shadow.normal, shadow.shape_id, shadow.cache_index );
+                float lit   = (1.0f - shadow.fog) * light;
+                // the reflection may not be traced (see PATH_TERMINATION), then the surface color takes its part
+                float reflectivity = shadow.reflectivity, reflection_weight = 0.0f;
+                if (reflectivity > 0.0f) {
+                    reflection_weight = PathWeight( shadow.path_weight, reflectivity, shadow.fog );
+                    float continuation = PathContinuation( reflection_weight );
+                    reflectivity      *= continuation;
+                    reflection_weight *= continuation;
+                }
+                color3 local = shadow.color * (lit * (1.0f - reflectivity)) + FOG * shadow.fog;
+                wave.pixels[shadow.pixel] = wave.pixels[shadow.pixel] + local * shadow.weight;
+                if (reflectivity > 0.0f) {
+                    RT_COUNT( reflections[std::min( bounce, TRACKED_BOUNCES - 1 )] );
+                    wave.paths.push_back( { ReflectionRay( shadow.incoming, shadow.normal ), shadow.weight * lit * reflectivity,
+                                            reflection_weight, shadow.pixel, -1 } );
+                }
+            }
+        }
+
+        for (int p = 0; p < pixel_count; p++) {
+            int x = x_start + p % tile_width;
+            int y = y_start + p / tile_width;
+            image.at( x, y ) = accumulation.Add( y * settings.width + x, wave.pixels[p], frame_samples );
+        }
+    }
+
+    // determine the offset (in [0, 1) x [0, 1)) of sample sample_index within pixel (x, y), according to SAMPLE_PATTERN
+    // sample_count is the number of samples this pixel takes in this frame, over which the STRATIFIED pattern spreads them
+    void PixelOffset( int x, int y, int sample_index, int sample_count, pcg32 &rng, float &offsetX, float &offsetY ) const {
+        const SampleTables &tables = SampleTables::Get();
+
+        switch (SAMPLE_PATTERN) {
+            case SamplePattern::RANDOM: {
+                offsetX = rng.next_float();
+                offsetY = rng.next_float();
+            } break;
+            case SamplePattern::STRATIFIED: {
+                // put the samples of this frame in a grid of columns x rows cells, and jitter each sample within its cell
+                int columns = 1;
+                while ((columns + 1) * (columns + 1) <= sample_count) columns++;
+                int rows = (sample_count + columns - 1) / columns;
+                offsetX = ((sample_index % columns) + rng.next_float()) / float( columns );
+                offsetY = ((sample_index / columns) + rng.next_float()) / float( rows    );
+            } break;
+            case SamplePattern::SOBOL:
+            case SamplePattern::BLUE_NOISE: {
+                // consecutive frames continue along the sequence instead of repeating the same points, so the
+                // samples accumulated over multiple frames are stratified as a whole
+                int index = int( (SampleSequenceStart() + sample_index) % SampleTables::SOBOL_SIZE );
+                // shift the sequence per pixel (Cranley-Patterson rotation) to prevent structured aliasing between pixels
+                // the shift has to stay the same over the frames, so it only depends on the pixel position
+                float shiftX, shiftY;
+                if (SAMPLE_PATTERN == SamplePattern::SOBOL) {
+                    pcg32 pixel_rng( uint64_t( y * settings.width + x ));
+                    shiftX = pixel_rng.next_float();
+                    shiftY = pixel_rng.next_float();
+                } else {
+                    int mask_index = (y % SampleTables::MASK_SIZE) * SampleTables::MASK_SIZE + (x % SampleTables::MASK_SIZE);
+                    shiftX = tables.blue_noise[0][mask_index];
+                    shiftY = tables.blue_noise[1][mask_index];
+                }
+                offsetX = tables.sobol[index][0] + shiftX;
+                offsetY = tables.sobol[index][1] + shiftY;
+                if (offsetX >= 1.0f) offsetX -= 1.0f;
+                if (offsetY >= 1.0f) offsetY -= 1.0f;
+            } break;
+        }
+    }
+
+    // the cell (row by row) of the index-th adaptive sample of a pixel, in the grid of ADAPTIVE_MAX_SAMPLES cells that
+    // PixelOffset() makes: each base 4 digit of index (lowest first) picks a quarter of the cell chosen so far, in the
+    // order top left, bottom right, top right, bottom left. So the first two samples are in different halves of the
+    // pixel both ways, the first four in different quarters, and so on
+    static int AdaptiveStratum( int index ) {
+        int bits = 0, column = 0, row = 0;
+        while ((1 << (2 * bits)) < ADAPTIVE_MAX_SAMPLES)
+            bits++;
+        for (int b = 0; b < bits; b++) {
+            int digit = (index >> (2 * b)) & 3;
+            column |= (digit == 1 || digit == 2) << (bits - 1 - b);
+            row    |= (digit == 1 || digit == 3) << (bits - 1 - b);
+        }
+        return row * (1 << bits) + column;
+    }
+
+    // fill in the guides of the denoiser for the pixels [x_start, x_end) x [y_start, y_end)
+    void RenderGuides( int x_start, int y_start, int x_end, int y_end ) {
+        for (int y = y_start; y < y_end; y++) {
+            for (int x = x_start; x < x_end; x++) {
+                int pixel = y * settings.width + x;
+                ray r = PrimaryRay( x - half_width + 0.5f, y - half_height + 0.5f );
+                hit_record hit = bvh.ClosestHit( r, shapes, cull_distance );
+                if (hit.shape_id < 0 || hit.t >= settings.fog_distance) {
+                    guides.Set( pixel, r.direction * -1.0f, settings.fog_distance, FOG, -1, vf3d( 0.0f ));
+                    continue;
+                }
+                hit.point = (r * hit.t).end();
+                VisitShape( shapes[hit.shape_id], [&]( const auto &shape ) { shape.surface( hit ); } );
+                guides.Set( pixel, hit.normal, hit.t, VisitShape( shapes[hit.shape_id], [&]( const auto &shape ) { return shape.sample( hit ); } ),
+                            hit.shape_id, hit.point );
+            }
+        }
+    }
+
+    // start the (just cleared) pixels [x_start, x_end) x [y_start, y_end) with the accumulated color of the previous frame
+    // where their primary hit was then, if the previous frame saw the same point there (see TEMPORAL_REUSE)
+    void ReprojectHistory( int x_start, int y_start, int x_end, int y_end ) {
+        for (int y = y_start; y < y_end; y++) {
+            for (int x = x_start; x < x_end; x++) {
+                int pixel = y * settings.width + x;
+                int shape = guides.shape[pixel];
+                int previous_pixel = pixel;
+                if (shape >= 0) {
+                    // where the point was, and the pixel whose center ray went through it (the inverse of PrimaryRay())
+                    vf3d  point = guides.point[pixel] - shape_motion[shape];
+                    float depth = point.z + 800.0f;
+                    if (!(depth > 1.0f))
+                        continue;
+                    float px = floorf( point.x * 2.0f * settings.height / depth + half_width );
+                    float py = floorf( point.y * 2.0f * settings.height / depth + half_height );
+                    if (!(px >= 0.0f && px < settings.width && py >= 0.0f && py < settings.height))
+                        continue;
+                    previous_pixel = int( py ) * settings.width + int( px );
+                    // the pixel there has to have seen the same Shape at (nearly) the same distance
+                    float distance = (point - vf3d( 0.0f, 0.0f, -800.0f )).length();
+                    if (fabsf( history_guides.depth[previous_pixel] - distance ) > TEMPORAL_DEPTH_TOLERANCE * distance)
+                        continue;
+                }
+                if (history_guides.shape[previous_pixel] != shape || history.count[previous_pixel] == 0)
+                    continue;
+                int    count   = std::min( history.count[previous_pixel], TEMPORAL_MAX_HISTORY );
+                color3 average = history.Average( previous_pixel );
+                float  luminance = AccumulationBuffer::Luminance( average );
+                accumulation.Add( pixel, average * float( count ), count, luminance * luminance * count );
+            }
+        }
+    }
+
+    // filter the image into denoised (see DENOISE): each pass blurs with a 5 x 5 B3 spline kernel, weighing each tap by
+    // how much its guides and color differ from those of the center pixel. The passes work on the color planes of
+    // denoise_planes, alternating between its two sets, and each pass is spread over the threads by rows.
+    void Denoise() {
+        RT_ZONE( "Denoise" );
+        int pixel_count = settings.width * settings.height;
+        if (denoised.width != settings.width || denoised.height != settings.height)
+            denoised.Resize( settings.width, settings.height );
+        for (color_planes &planes : denoise_planes)
+            for (std::vector<float> &plane : planes)
+                plane.resize( pixel_count );
+        for (int pixel = 0; pixel < pixel_count; pixel++) {
+            denoise_planes[0][0][pixel] = image.pixels[pixel].x;
+            denoise_planes[0][1][pixel] = image.pixels[pixel].y;
+            denoise_planes[0][2][pixel] = image.pixels[pixel].z;
+        }
+        int source = 0;
+        for (int i = 0; i < DENOISE_ITERATIONS; i++) {
+            // the wider passes are stricter about color, so they don't smear the edges the first passes kept
+            float color_sigma = DENOISE_COLOR_SIGMA / float( 1 << i );
+            tile_pool.Run( settings.height, [&]( int y, int ) {
+                DenoiseRow( denoise_planes[source], denoise_planes[1 - source], y, 1 << i, color_sigma );
+            } );
+            source = 1 - source;
+        }
+        for (int pixel = 0; pixel < pixel_count; pixel++)
+            denoised.pixels[pixel] = color3( denoise_planes[source][0][pixel], denoise_planes[source][1][pixel], denoise_planes[source][2][pixel] );
+    }
+
+    // one pass of Denoise() for row y, with step pixels between the taps
+    // the taps are the outer loops, so the inner loop goes over consecutive pixels (with their taps at the same offset),
+    // which with RT_SIMD handles 8 pixels at a time (machines with AVX-512 have AVX2 as well, and the loop is bound by
+    // its loads rather than its arithmetic)
+    using color_planes = std::array<std::vector<float>, 3>;
+    void DenoiseRow( const color_planes &source, color_planes &target, int y, int step, float color_sigma ) const {
+        static constexpr float KERNEL[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+        int width = settings.width;
+        const float *__restrict red      = source[0].data();
+        const float *__restrict green    = source[1].data();
+        const float *__restrict blue     = source[2].data();
+        const float *__restrict normal_x = guides.normal[0].data();
+        const float *__restrict normal_y = guides.normal[1].data();
+        const float *__restrict normal_z = guides.normal[2].data();
+        const float *__restrict albedo_r = guides.albedo[0].data();
+        const float *__restrict albedo_g = guides.albedo[1].data();
+        const float *__restrict albedo_b = guides.albedo[2].data();
+        const float *__restrict depths   = guides.depth.data();
+
+        // per pixel of the row: its luminance and the scales of the color and depth differences, and the weighted sum
+        // of its taps - kept per thread, so the memory is reused between rows
+        static thread_local std::vector<float> luminances, color_scales, depth_scales, sums[4];
+        luminances.resize( width );
+        color_scales.resize( width );
+        depth_scales.resize( width );
+        for (std::vector<float> &sum : sums)
+            sum.assign( width, 0.0f );
+        for (int x = 0; x < width; x++) {
+            int pixel = y * width + x;
+            luminances[x] = 0.2126f * red[pixel] + 0.7152f * green[pixel] + 0.0722f * blue[pixel];
+            // the noise of the average of n samples goes down with sqrt( n )
+            color_scales[x] = sqrtf( float( std::max( accumulation.count[pixel], 1 ))) / color_sigma;
+            depth_scales[x] = 1.0f / (DENOISE_DEPTH_SIGMA * depths[pixel] * step);
+        }
+
+        float *__restrict sum_r      = sums[0].data();
+        float *__restrict sum_g      = sums[1].data();
+        float *__restrict sum_b      = sums[2].data();
+        float *__restrict sum_weight = sums[3].data();
+        const float *__restrict luminance   = luminances.data();
+        const float *__restrict color_scale = color_scales.data();
+        const float *__restrict depth_scale = depth_scales.data();
+        for (int dy = -2; dy <= 2; dy++) {
+            int ty = y + dy * step;
+            if (ty < 0 || ty >= settings.height)
+                continue;
+            for (int dx = -2; dx <= 2; dx++) {
+                int   offset = dx * step;
+                float kernel = KERNEL[dy + 2] * KERNEL[dx + 2];
+                const int first_pixel = y * width, first_tap = ty * width + offset;
+                int x = std::max( 0, -offset ), x_end = std::min( width, width - offset );
+#ifdef RT_SIMD
+                const __m256 abs_mask = _mm256_castsi256_ps( _mm256_set1_epi32( 0x7FFFFFFF ));
+                const __m256 zero = _mm256_setzero_ps();
+                for (; x + 8 <= x_end; x += 8) {
+                    int p = first_pixel + x, t = first_tap + x;
+                    __m256 r = _mm256_loadu_ps( red + t ), g = _mm256_loadu_ps( green + t ), b = _mm256_loadu_ps( blue + t );
+                    __m256 tap_luminance = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( _mm256_set1_ps( 0.2126f ), r ),
+                                                                         _mm256_mul_ps( _mm256_set1_ps( 0.7152f ), g )),
+                                                                         _mm256_mul_ps( _mm256_set1_ps( 0.0722f ), b ));
+                    __m256 dr = _mm256_sub_ps( _mm256_loadu_ps( albedo_r + t ), _mm256_loadu_ps( albedo_r + p ));
+                    __m256 dg = _mm256_sub_ps( _mm256_loadu_ps( albedo_g + t ), _mm256_loadu_ps( albedo_g + p ));
+                    __m256 db = _mm256_sub_ps( _mm256_loadu_ps( albedo_b + t ), _mm256_loadu_ps( albedo_b + p ));
+                    __m256 color_difference = _mm256_and_ps( _mm256_sub_ps( tap_luminance, _mm256_loadu_ps( luminance + x )), abs_mask );
+                    __m256 depth_difference = _mm256_and_ps( _mm256_sub_ps( _mm256_loadu_ps( depths + t ), _mm256_loadu_ps( depths + p )), abs_mask );
+                    __m256 albedo_difference = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( dr, dr ), _mm256_mul_ps( dg, dg )), _mm256_mul_ps( db, db ));
+                    __m256 difference = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( color_difference, _mm256_loadu_ps( color_scale + x )),
+                                                                      _mm256_mul_ps( depth_difference, _mm256_loadu_ps( depth_scale + x ))),
+                                                                      _mm256_mul_ps( albedo_difference, _mm256_set1_ps( 1.0f / DENOISE_ALBEDO_SIGMA )));
+                    __m256 facing = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( _mm256_loadu_ps( normal_x + p ), _mm256_loadu_ps( normal_x + t )),
+                                                                  _mm256_mul_ps( _mm256_loadu_ps( normal_y + p ), _mm256_loadu_ps( normal_y + t ))),
+                                                                  _mm256_mul_ps( _mm256_loadu_ps( normal_z + p ), _mm256_loadu_ps( normal_z + t )));
+                    facing = _mm256_max_ps( facing, zero );
+                    for (int power = 1; power < DENOISE_NORMAL_POWER; power *= 2)
+                        facing = _mm256_mul_ps( facing, facing );
+                    __m256 weight = _mm256_mul_ps( _mm256_mul_ps( _mm256_set1_ps( kernel ), FastExp( _mm256_sub_ps( zero, difference ))), facing );
+                    _mm256_storeu_ps( sum_r + x,      _mm256_add_ps( _mm256_loadu_ps( sum_r + x ), _mm256_mul_ps( r, weight )));
+                    _mm256_storeu_ps( sum_g + x,      _mm256_add_ps( _mm256_loadu_ps( sum_g + x ), _mm256_mul_ps( g, weight )));
+                    _mm256_storeu_ps( sum_b + x,      _mm256_add_ps( _mm256_loadu_ps( sum_b + x ), _mm256_mul_ps( b, weight )));
+                    _mm256_storeu_ps( sum_weight + x, _mm256_add_ps( _mm256_loadu_ps( sum_weight + x ), weight ));
+                }
+#endif // RT_SIMD
+                for (; x < x_end; x++) {
+                    int p = first_pixel + x, t = first_tap + x;
+                    float tap_luminance = 0.2126f * red[t] + 0.7152f * green[t] + 0.0722f * blue[t];
+                    float dr = albedo_r[t] - albedo_r[p], dg = albedo_g[t] - albedo_g[p], db = albedo_b[t] - albedo_b[p];
+                    float difference = fabsf( tap_luminance - luminance[x] ) * color_scale[x]
+                                     + fabsf( depths[t] - depths[p] ) * depth_scale[x]
+                                     + (dr * dr + dg * dg + db * db) * (1.0f / DENOISE_ALBEDO_SIGMA);
+                    float facing = std::max( 0.0f, normal_x[p] * normal_x[t] + normal_y[p] * normal_y[t] + normal_z[p] * normal_z[t] );
+                    float weight = kernel * FastExp( -difference ) * PowerOfTwoPower<DENOISE_NORMAL_POWER>( facing );
+                    sum_r[x]      += red[t]   * weight;
+                    sum_g[x]      += green[t] * weight;
+                    sum_b[x]      += blue[t]  * weight;
+                    sum_weight[x] += weight;
+                }
+            }
+        }
+        for (int x = 0; x < width; x++) {
+            int pixel = y * width + x;
+            // (the center tap always has a weight, unless its normal is degenerate)
+            bool weighted = sum_weight[x] > 0.0f;
+            target[0][pixel] = weighted ? sum_r[x] / sum_weight[x] : red[pixel];
+            target[1][pixel] = weighted ? sum_g[x] / sum_weight[x] : green[pixel];
+            target[2][pixel] = weighted ? sum_b[x] / sum_weight[x] : blue[pixel];
+        }
+    }
+
+    // create a (normalized) ray casting into the scene from this "pixel"
+    // both coordinates are scaled by the height, so a wider image shows more of the scene instead of stretching it
+    ray PrimaryRay( float x, float y ) const {
+        ThreadRayCounts().primary++;
+        ray sample_ray({ 0, 0, -800 }, { (x / float(settings.height)) * 100, (y / float(settings.height)) * 100, 200 });
+        return sample_ray.normalize();
+    }
+
+    // the pixels [x0, x1] x [y0, y1] (as { x0, y0, x1, y1 }) whose primary rays can hit box, i.e. the (conservative)
+    // inverse of PrimaryRay() for the corners of box - a box that reaches behind the camera covers all pixels
+    std::array<int, 4> ScreenBounds( const aabb &box ) const {
+        float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+        for (int corner = 0; corner < 8; corner++) {
+            vf3d point( corner & 1 ? box.max.x : box.min.x, corner & 2 ? box.max.y : box.min.y, corner & 4 ? box.max.z : box.min.z );
+            float depth = point.z + 800.0f;
+            if (!(depth > 1.0f) || !std::isfinite( point.x ) || !std::isfinite( point.y ))
+                return { 0, 0, settings.width - 1, settings.height - 1 };
+            float x = point.x * 2.0f * settings.height / depth + half_width;
+            float y = point.y * 2.0f * settings.height / depth + half_height;
+            x0 = std::min( x0, x ); y0 = std::min( y0, y );
+            x1 = std::max( x1, x ); y1 = std::max( y1, y );
+        }
+        // a pixel's rays have offsets in [0, 1), and one more pixel on each side covers rounding
+        x0 = std::clamp( x0, -2.0f, float( settings.width  )); x1 = std::clamp( x1, -2.0f, float( settings.width  ));
+        y0 = std::clamp( y0, -2.0f, float( settings.height )); y1 = std::clamp( y1, -2.0f, float( settings.height ));
+        return { int( floorf( x0 )) - 2, int( floorf( y0 )) - 2, int( ceilf( x1 )) + 1, int( ceilf( y1 )) + 1 };
+    }
+
+    color3 rtSample( float x, float y ) {
+        // sample the ray from this "pixel" - if the ray doesn't hit anything, use the color of the fog
+        return SampleRay( PrimaryRay( x, y ), settings.bounces ).value_or( FOG );
+    }
+
+    // returns true if any Shape in the scene intersects ray r closer than max_distance
+    bool Occluded( ray r, float max_distance ) const {
+        ThreadRayCounts().shadow++;
+        RT_COUNT( shadow_rays );
+        bool occluded;
+        {
+            RT_TIME( intersection_ns );
+            occluded = bvh.AnyHit( r, shapes, max_distance );
+        }
+        if (occluded)
+            RT_COUNT( shadow_occluded );
+        return occluded;
+    }
+
+    // same as Occluded(), for the shadow ray from point on Shape shape_id towards target (on a light), but with the part
+    // of the answer that depends on the static Shapes taken from entry cache_index of the shadow cache if it was computed
+    // for the same points before
+    bool OccludedCached( ray r, float max_distance, int shape_id, const vf3d &point, const vf3d &target, int cache_index ) {
+        if (cache_index < 0 || shape_animated[shape_id])
+            return Occluded( r, max_distance );
+
+        shadow_cache_entry &entry = shadow_cache[cache_index];
+        bool occluded;
+        if (entry.shape_id == shape_id && entry.point.x == point.x && entry.point.y == point.y && entry.point.z == point.z &&
+            entry.target.x == target.x && entry.target.y == target.y && entry.target.z == target.z) {
+            RT_COUNT( shadow_cache_hits );
+            occluded = entry.occluded;
+        } else {
+            ThreadRayCounts().shadow++;
+            RT_COUNT( shadow_rays );
+            {
+                RT_TIME( intersection_ns );
+                occluded = static_bvh.AnyHit( r, shapes, max_distance );
+            }
+            entry = { point, target, shape_id, occluded };
+        }
+        // the moving Shapes are few, so they're just tested one by one
+        for (size_t i = 0; i < animated_shapes.size() && !occluded; i++)
+            occluded = VisitShape( shapes[animated_shapes[i]], [&]( const auto &s ) { return s.occluded( r, max_distance ); } );
+        if (occluded)
+            RT_COUNT( shadow_occluded );
+        return occluded;
+    }
+
+    // cache_index is the entry of the shadow cache for the hit of a primary ray, or -1 to not use the cache, and weight is
+    // how much the color of the ray can add to its pixel (see PATH_TERMINATION)
+    std::optional<color3> SampleRay( ray r, int bounces, int cache_index = -1, float weight = 1.0f ) {
+        RT_ZONE( "SampleRay" );
+        // find the closest Shape this ray intersects with, and the distance along the ray where that occurs
+        hit_record hit;
+        {
+            RT_TIME( intersection_ns );
+            hit = bvh.ClosestHit( r, shapes, cull_distance );
+        }
+        return ShadeHit( r, hit, bounces, cache_index, weight );
+    }
+
+    // get the color produced by ray r, given the closest hit of that ray (with only t and shape_id filled in)
+    std::optional<color3> ShadeHit( ray r, hit_record hit, int bounces, int cache_index = -1, float weight = 1.0f ) {
+        // primary rays don't need to be in the footprint of the tile, they're covered by ScreenBounds()
+        bool secondary = bounces != settings.bounces;
+        bounces -= 1;
+
+        // called to get the color produced by a specific ray
+        // this will be the color we (eventually) return
+        color3 final_color;
+
+        // if we didn't intersect with any Shapes, return an empty optional
+        if (hit.shape_id < 0) {
+            RT_COUNT( misses );
+            // (with FOG_CULLING the ray may have passed Shapes beyond the fog distance, which can't change its color)
+            if (secondary)
+                AddToFootprint( r, cull_distance );
+            return {};
+        }
+        // else get the shape we discovered
+        const ShapeStorage &intersected_storage = shapes[hit.shape_id];
+        const Shape &intersected_shape = AsShape( intersected_storage );
+
+        // quick check - if the intersection is further away than the furthest Fog point,
+        // then we can save some time and not calculate anything further, since it would
+        // be obscured by Fog regardless.
+        if (secondary)
+            AddToFootprint( r, hit.t );
+        if (hit.t >= settings.fog_distance) {
+            RT_COUNT( fog_early_outs );
+            return FOG;
+        }
+
+        // complete the hit record: determine the point at which our ray intersects the Shape, and the normal
+        // and surface coordinates of the Shape at that point. This is the only place where they're calculated.
+        hit.point = (r * hit.t).end();
+        VisitShape( intersected_storage, [&]( const auto &shape ) { shape.surface( hit ); } );
+        ray normal( hit.point, hit.normal );
+
+        // set our color to the sampled color of the Shape at the hit
+        final_color = VisitShape( intersected_storage, [&]( const auto &shape ) { return shape.sample( hit ); } );
+
+        // apply reflection, unless it can hardly be seen (see PATH_TERMINATION)
+        float reflection_weight = 0.0f, continuation = 0.0f;
+        if (bounces != 0 && intersected_shape.reflectivity > 0.0f) {
+            reflection_weight = PathWeight( weight, std::min( intersected_shape.reflectivity, 1.0f ),
+                                            fog_intensity ? std::clamp( hit.t * fog_intensity, 0.0f, 1.0f ) : 0.0f );
+            continuation = PathContinuation( reflection_weight );
+        }
+        if (continuation > 0.0f) {
+            RT_COUNT( reflections[std::min( settings.bounces - 1 - bounces, TRACKED_BOUNCES - 1 )] );
+            // recursion! since the SampleRay doesn't care if the ray is coming from the canvas,
+            // we can use it to get the color that will be reflected by this Shape
+            std::optional<color3> reflected_color = SampleRay( ReflectionRay( r, normal ), bounces, -1, reflection_weight * continuation );
+
+            // finally, mix our Shape's colour with the reflected color (or Fog color, in case of a miss)
+            // according to the reflectivity (which Russian roulette scales up, beyond what lerp() allows)
+            if (continuation == 1.0f)
+                final_color = lerp( final_color, reflected_color.value_or( FOG ), intersected_shape.reflectivity );
+            else
+                final_color = final_color + (reflected_color.value_or( FOG ) - final_color) * (std::min( intersected_shape.reflectivity, 1.0f ) * continuation);
+        }
+
+        // apply lighting
+        final_color = final_color * DirectLight( normal, hit.shape_id, cache_index );
+
+		// Apply Fog
+		if (fog_intensity)
+			final_color = lerp(final_color, FOG, hit.t * fog_intensity);
+
+        return final_color;
+    }
+
+    // create the ray that reflects incoming ray r around the given surface normal
+    ray ReflectionRay( const ray &r, const ray &normal ) const {
+        ThreadRayCounts().reflection++;
+        // our reflection ray starts out as our normal
+        ray reflection = normal;
+        // apply a slight offset *along* the normal. This way our reflected ray will start at
+        // some slight offset from the surface so that rounding errors don't cause it to collide
+        // with the Shape it originated from
+        reflection.origin = reflection.origin + (normal.direction + 0.001f);
+        // reflect the direction around the normal with some simple geometry
+        reflection.direction = (normal.direction * (2 * ((r.direction * -1.0f) * normal.direction)) + r.direction).normalize();
+        return reflection;
+    }
+
+    // the weight of the reflection of a hit (see PATH_TERMINATION), for the weight of the ray that hit it, the clamped
+    // reflectivity of the surface and the fog factor of the hit. The GPU kernel (see gpu_sample()) does the same
+    static float PathWeight( float weight, float reflectivity, float fog ) {
+        return weight * reflectivity * (1.0f - fog);
+    }
+
+    // whether to trace a reflection ray with the given weight (see PATH_TERMINATION): 0 if it isn't traced, or else the
+    // factor by which its reflectivity is scaled up to make up for the reflections that aren't traced (1 if all are)
+    float PathContinuation( float weight ) {
+        if (PATH_TERMINATION == PathTermination::NONE || weight >= PATH_WEIGHT_THRESHOLD)
+            return 1.0f;
+        float survival = weight / PATH_WEIGHT_THRESHOLD;
+        if (PATH_TERMINATION == PathTermination::RUSSIAN_ROULETTE && ThreadShadingRng().next_float() < survival)
+            return 1.0f / survival;
+        RT_COUNT( paths_terminated );
+        return 0.0f;
+    }
+
+    // the factor that the color of a surface is multiplied by for lighting (see LIGHT_SAMPLES): the shadow rays towards
+    // the lights are traced from the origin of the surface normal on Shape shape_id, with entry cache_index of the shadow
+    // cache (or -1) for the first shadow ray of a primary hit
+    float DirectLight( const ray &normal, int shape_id, int cache_index ) {
+        if (lights.empty())
+            return settings.ambient_light;
+        // a single point light doesn't need more than one ray, or any random numbers
+        bool exact = lights.size() == 1 && lights[0].radius <= 0.0f;
+        int  ray_count = exact ? 1 : LIGHT_SAMPLES;
+        pcg32 &rng = ThreadShadingRng();
+
+        float light = 0.0f;
+        bool  lit   = false;
+        for (int i = 0; i < ray_count; i++) {
+            float probability = 1.0f;
+            const Light &source = exact ? lights[0] : lights[PickLight( rng.next_float(), probability )];
+            vf3d target = source.radius > 0.0f ? LightPoint( source, normal.origin, rng ) : source.position;
+
+            float light_distance;
+            ray light_ray = LightRay( normal, target, light_distance );
+            AddToFootprint( light_ray, light_distance );
+            // then search for any Shape that is occluding the light ray
+            // we don't care if any of the Shapes intersect the ray beyond the light, so the search is limited to the light distance
+            if (!OccludedCached( light_ray, light_distance, shape_id, normal.origin, target, cache_index < 0 ? -1 : cache_index * LIGHT_SAMPLES + i )) {
+                // (each light counts with the inverse of the chance it's picked, so on average they all count once)
+                light += source.intensity * (light_ray.direction * normal.direction) / probability;
+                lit = true;
+            }
+        }
+        return LightIntensity( light / float( ray_count ), lit );
+    }
+
+    // the index of the light for a uniform random number u in [0, 1), and the probability that it's picked
+    int PickLight( float u, float &probability ) const {
+        float total = light_cdf.back();
+        if (!(total > 0.0f)) {
+            probability = 1.0f / float( lights.size());
+            return std::min( int( u * float( lights.size())), int( lights.size()) - 1 );
+        }
+        int index = int( std::upper_bound( light_cdf.begin(), light_cdf.end(), u * total ) - light_cdf.begin());
+        index = std::min( index, int( lights.size()) - 1 );
+        probability = (light_cdf[index] - (index > 0 ? light_cdf[index - 1] : 0.0f)) / total;
+        return index;
+    }
+
+    // a uniformly distributed random point on the disk of an area light that faces point
+    static vf3d LightPoint( const Light &light, const vf3d &point, pcg32 &rng ) {
+        vf3d w = (light.position - point).normalize();
+        // two directions perpendicular to w (and each other)
+        vf3d helper = fabsf( w.x ) > 0.9f ? vf3d( 0, 1, 0 ) : vf3d( 1, 0, 0 );
+        vf3d u( helper.y * w.z - helper.z * w.y, helper.z * w.x - helper.x * w.z, helper.x * w.y - helper.y * w.x );
+        u = u.normalize();
+        vf3d v( w.y * u.z - w.z * u.y, w.z * u.x - w.x * u.z, w.x * u.y - w.y * u.x );
+        float distance = light.radius * sqrtf( rng.next_float());
+        float angle    = 6.28318531f * rng.next_float();
+        return light.position + u * (distance * cosf( angle )) + v * (distance * sinf( angle ));
+    }
+
+    // the random generator for the light samples and path termination of the current thread - RenderTile() seeds it for
+    // each tile, so the result doesn't depend on which thread renders the tile
+    static pcg32 &ThreadShadingRng() {
+        static thread_local pcg32 rng( 0 );
+        return rng;
+    }
+
+    // create the (normalized) ray from the origin of the surface normal to target (on a light), and get the distance to it
+    ray LightRay( const ray &normal, const vf3d &target, float &light_distance ) const {
+        // first get the (un-normalized) ray from our intersection point to the light source
+        ray light_ray = ray( normal.origin, target - normal.origin );
+        // get distance to the light (i.e. the length of tue un-normalized ray)
+        light_distance = light_ray.direction.length();
+        // also offset the origin of the light ray with a small amount along the surface normal so the ray
+        // doesn't intersect with the shape itself
+        light_ray.origin = light_ray.origin + (normal.direction *  0.001f);
+        // and finally normalize the light_ray
+        light_ray.direction = light_ray.direction.normalize();
+        return light_ray;
+    }
+
+    // get the factor that the color of a surface is multiplied by for lighting, from the light that reaches it (the sum
+    // of the dot products between surface normal and light rays, times the intensities), if any light reaches it
+    float LightIntensity( float light, bool lit ) const {
+        // if no light reaches the surface - use the ambient light to darken the surface
+        if (!lit)
+            return settings.ambient_light;
+        // otherwise add in the ambient light so no surfaces are entirely dark, and clamp to prevent negative values
+        // (surfaces pointing away from the light are darkened)
+        return std::clamp( settings.ambient_light + light, 0.0f, 1.0f );
+    }
+
+private:
+    RenderSettings settings;
+
+    // the GPU backend, with the signature of the scene it has, and the samples per pixel it accumulated since (0 to start over)
+    GpuBackend gpu;
+    uint64_t   gpu_signature = 0;
+    int        gpu_samples   = 0;
+
+    // the number of tiles in each direction, the center of the image, the fog falloff (1 / fog distance), and how far
+    // the closest hit queries look (see FOG_CULLING)
+    int   tiles_x, tiles_y;
+    // the rows of tiles that are rendered (see RestrictTileRows())
+    int   tile_rows_begin = 0, tile_rows_end = -1;
+    float half_width, half_height;
+    float fog_intensity;
+    float cull_distance;
+
+    // the RenderPacket() function that is used for the current frame
+    PacketRenderer render_packet = &Renderer::RenderPacket<0>;
+
+    // the result of the last frame
+    Framebuffer image;
+    // for TEMPORAL_REUSE: the accumulated colors and the guides of the frame before the scene changed, the origins of the
+    // animated Shapes in that frame and how far each Shape moved since then, and whether all that is valid (and used)
+    AccumulationBuffer history;
+    GuideBuffer        history_guides;
+    std::vector<vf3d>  history_origins;
+    std::vector<vf3d>  shape_motion;
+    bool               history_valid = false;
+    bool               reproject     = false;
+
+    // the guides of the denoiser, its result, and the color planes of its passes (see DENOISE)
+    GuideBuffer  guides;
+    Framebuffer  denoised;
+    color_planes denoise_planes[2];
+
+    // the scene that was created, and the time of its animation (in seconds)
+    Scene scene = Scene::STEP6;
+    float accumulated_time = 0.0f;
+    // what moves in the scene, and the Shapes that changed in the last SetTime()
+    Animation         animation;
+    std::vector<int>  changed_shapes;
+    // the indices of the Shapes that move, and per Shape whether it moves
+    std::vector<int>  animated_shapes;
+    std::vector<bool> shape_animated;
+
+    // the BVH over the Shapes that don't move, and per sample of each pixel the visibility of the light from its primary
+    // hit considering only those Shapes (see SHADOW_CACHE)
+    struct shadow_cache_entry {
+        vf3d point;
+        vf3d target;
+        int  shape_id = -1;
+        bool occluded = false;
+    };
+    BVH                             static_bvh;
+    std::vector<shadow_cache_entry> shadow_cache;
+
+    void ResetShadowCache() {
+        shadow_cache.clear();
+        if (SHADOW_CACHE)
+            shadow_cache.resize( size_t( settings.width ) * settings.height * settings.samples * LIGHT_SAMPLES );
+    }
+    // the entry of the shadow cache for sample sample_index of pixel (x, y), or -1 if it doesn't have one
+    int ShadowCacheIndex( int x, int y, int sample_index ) const {
+        if (!SHADOW_CACHE || sample_index >= settings.samples)
+            return -1;
+        return (y * settings.width + x) * settings.samples + sample_index;
+    }
+
+    // the rays traced so far by the calling thread - the counters are per thread, so they don't need to be atomic
+    static RayCounts &ThreadRayCounts() {
+        static thread_local RayCounts counts;
+        return counts;
+    }
+    // the rays traced in the current frame per pool thread (each in its own cache line), and in the last frame in total
+    struct alignas( 64 ) thread_counts {
+        RayCounts       counts;
+#ifdef RT_INSTRUMENT
+        HotPathCounters hot;
+#endif
+    };
+    std::vector<thread_counts> thread_ray_counts;
+    RayCounts                  frame_ray_counts;
+
+    // the space the secondary rays of a tile passed through (see INCREMENTAL_RENDER)
+    struct tile_footprint {
+        aabb bounds;                // encloses the reflection and shadow rays of all samples accumulated in the tile
+        bool unbounded = false;     // some reflection ray didn't hit anything
+    };
+    // the footprint of the tile the calling thread is rendering
+    static tile_footprint &ThreadFootprint() {
+        static thread_local tile_footprint footprint;
+        return footprint;
+    }
+    // add the part of ray r up to distance t (INFINITY for a ray that didn't hit anything) to the footprint of the tile
+    static void AddToFootprint( const ray &r, float t ) {
+        if (!INCREMENTAL_RENDER)
+            return;
+        tile_footprint &footprint = ThreadFootprint();
+        if (t == INFINITY) {
+            footprint.unbounded = true;
+            return;
+        }
+        footprint.bounds.grow( r.origin );
+        footprint.bounds.grow( (r * t).end());
+    }
+    std::vector<tile_footprint> tile_footprints;
+    // the boxes swept by the moving Shapes since the last frame, the tiles to render in this frame,
+    // and whether those tiles start over (or add samples to what they accumulated before)
+    std::vector<aabb> moved_bounds;
+    std::vector<int>  dirty_tiles;
+    bool              reset_tiles = true;
+#ifdef RT_INSTRUMENT
+    HotPathCounters            frame_hot_counters;
+#endif
+
+    // the memory of the Shapes, and the arena they're moved to when they are sorted
+    ShapeArena arena, spare_arena;
+    ShapeList  shapes;
+
+    // acceleration structure over the shapes, used to find the Shapes a ray intersects
+    BVH bvh;
+
+    // the lights, and the running sum of their intensities (to pick them with, see PickLight())
+    std::vector<Light> lights;
+    std::vector<float> light_cdf;
+
+    // the worker threads that render the tiles of each frame
+    TilePool tile_pool;
+
+    // number of the frame that is being rendered (used to seed the per pixel random generators)
+    uint32_t frame_index = 0;
+
+    // samples per pixel in the current frame, and the number of samples taken in all previous frames together
+    // (the latter is where the SOBOL and BLUE_NOISE patterns continue along their sequence)
+    int      frame_samples  = SAMPLES;
+    uint64_t sequence_start = 0;
+    // the frames rendered since the accumulation was last reset, and sequence_start at that reset
+    uint32_t frames_since_reset = 0;
+    uint64_t sequence_at_reset  = 0;
+
+    // the seed of the per pixel random generators and the start of the sample sequence for this frame: with the shadow
+    // cache, every frame after a change of the scene takes the same samples (so the primary hits on static Shapes repeat)
+    uint32_t SampleSeed() const          { return SHADOW_CACHE ? frames_since_reset : frame_index; }
+    uint64_t SampleSequenceStart() const { return SHADOW_CACHE ? sequence_start - sequence_at_reset : sequence_start; }
+    // the total number of samples to spend on the current frame when ADAPTIVE_SAMPLING is enabled
+    int64_t  frame_budget   = ADAPTIVE_FRAME_BUDGET;
+
+    // the samples accumulated over the frames in which the scene didn't change
+    AccumulationBuffer accumulation;
+    uint64_t           scene_signature = 0;
+
+    // hash of everything in the scene that affects the image, used to detect changes between frames
+    uint64_t SceneSignature() const {
+        uint64_t h = pcg32::splitmix( shapes.size());
+        auto mix = [&h]( float f ) {
+            uint32_t bits;
+            memcpy( &bits, &f, sizeof( bits ));
+            h = pcg32::splitmix( h ^ bits );
+        };
+        auto mix3 = [&mix]( const vf3d &v ) { mix( v.x ); mix( v.y ); mix( v.z ); };
+
+        for (const Light &light : lights) {
+            mix3( light.position );
+            mix( light.radius );
+            mix( light.intensity );
+        }
+        for (const ShapeStorage &storage : shapes) {
+            const Shape &shape = AsShape( storage );
+            mix3( shape.origin );
+            mix3( shape.fill );
+            mix( shape.reflectivity );
+            // the bounds capture the size of finite Shapes
+            if (std::optional<aabb> box = shape.bounds()) {
+                mix3( box->min );
+                mix3( box->max );
+            }
+        }
+        return h;
+    }
+
+    // apply a linear interpolation between two colors - with RT_FAST_MATH by is clamped rather than branched on (the
+    // weights are exactly 1 and 0 at the ends, but the compiler may fuse the multiply-adds differently, so the colors
+    // in between can differ in the last bit)
+    color3 lerp( color3 from, color3 to, float by ) const {
+#ifdef RT_FAST_MATH
+        by = std::min( std::max( by, 0.0f ), 1.0f );
+#else
+        if (by <= 0.0f) return from;
+        if (by >= 1.0f) return to;
+#endif
+        return color3(
+            from.x * (1.0f - by) + to.x * by,
+            from.y * (1.0f - by) + to.y * by,
+            from.z * (1.0f - by) + to.z * by
+        );
+    }
+};
+
+
+#ifndef RT_HEADLESS
+
+#ifdef RT_TRACE
+// where the viewer writes its trace when it is closed
+constexpr const char *TRACE_FILE = "raytracer_trace.json";
+#endif
+
+// keeps the frame time within FRAME_TIME_BUDGET by stepping through a list of quality levels, from the full
+// quality of the base settings down to rendering 1 sample at a quarter of the resolution without reflections
+class FrameTimeController {
+public:
+    explicit FrameTimeController( const RenderSettings &_base ) {
+        Reset( _base );
+    }
+
+    // start over from the full quality of new base settings
+    void Reset( const RenderSettings &_base ) {
+        base = _base;
+        levels.clear();
+        // first take fewer samples, then lower the resolution, then cut the bounces, and lower the resolution further
+        int samples = base.samples;
+        levels.push_back( { 1.0f, samples, base.bounces } );
+        while (samples > 1) {
+            samples = (samples + 1) / 2;
+            levels.push_back( { 1.0f, samples, base.bounces } );
+        }
+        for (float scale : { 0.75f, 0.5f })
+            levels.push_back( { scale, 1, base.bounces } );
+        for (int bounces = base.bounces / 2; bounces >= 1; bounces /= 2)
+            levels.push_back( { 0.5f, 1, bounces } );
+        for (float scale : { 0.35f, 0.25f })
+            levels.push_back( { scale, 1, 1 } );
+        current = 0;
+        average_time = 0.0f;
+        frames_at_level = 0;
+    }
+
+    // feed the duration of the last frame - returns true if the quality level changed
+    bool Update( float frame_time ) {
+        // a smoothed frame time, so a single slow frame doesn't change the level
+        average_time = frames_at_level == 0 ? frame_time : average_time + (frame_time - average_time) * 0.2f;
+        frames_at_level++;
+        // give each level a few frames to settle first
+        if (frames_at_level < 8)
+            return false;
+        int next = current;
+        if (average_time > FRAME_TIME_BUDGET * 1.1f && current + 1 < int( levels.size()))
+            next = current + 1;
+        // only go up when even a level that is twice as expensive would (likely) fit in the budget
+        else if (average_time < FRAME_TIME_BUDGET * 0.5f && current > 0)
+            next = current - 1;
+        if (next == current)
+            return false;
+        current = next;
+        frames_at_level = 0;
+        return true;
+    }
+
+    // the base settings, at the current quality level
+    RenderSettings Settings() const {
+        const level &l = levels[current];
+        RenderSettings settings = base;
+        settings.width   = std::max( 1, int( base.width  * l.scale ));
+        settings.height  = std::max( 1, int( base.height * l.scale ));
+        settings.samples = l.samples;
+        settings.bounces = l.bounces;
+        return settings;
+    }
+
+    const RenderSettings &Base() const { return base; }
+    float Scale()        const { return levels[current].scale; }
+    float AverageTime()  const { return average_time; }
+
+private:
+    struct level {
+        float scale;
+        int   samples;
+        int   bounces;
+    };
+    RenderSettings     base;
+    std::vector<level> levels;
+    int                current;
+    float              average_time;
+    int                frames_at_level;
+};
+
+// the interactive viewer: animates and renders the scene every frame, and shows the result in the window
+class RayTracer : public olc::PixelGameEngine {
+public:
+    // scene_file is a scene file to show instead of the scene of step 6
+    explicit RayTracer( const RenderSettings &settings = RenderSettings(), const std::string &_scene_file = "" )
+        : renderer( settings ), controller( settings ), scene_file( _scene_file ) {
+        sAppName = "RayTracer";
+    }
+
+public:
+    bool OnUserCreate() override {
+        if (scene_file.empty()) {
+            renderer.CreateScene();
+        } else if (!renderer.LoadScene( scene_file )) {
+            fprintf( stderr, "can't load scene file %s\n", scene_file.c_str() );
+            return false;
+        }
+        return true;
+    }
+
+    bool OnUserUpdate( float fElapsedTime ) override {
+		// Called once per frame
+
+        // with PIPELINE_FRAMES, the frame to draw was traced while the previous one was presented - only the first
+        // frame is traced right here. The renderer (and the scene in it) is only touched by the frame thread until
+        // Wait() returns, so each frame sees the scene as it was when it was started.
+        if (PIPELINE_FRAMES && frame_in_flight) {
+            pipeline.Wait();
+            presented = renderer.Image();
+            UpdateSettings( fElapsedTime );
+        } else {
+            UpdateSettings( fElapsedTime );
+            TraceFrame( fElapsedTime );
+            if (PIPELINE_FRAMES)
+                presented = renderer.Image();
+        }
+        // start on the next frame, with the time of this one as the best guess for how far the scene moves
+        if (PIPELINE_FRAMES) {
+            pipeline.Start( [this, fElapsedTime] { TraceFrame( fElapsedTime ); } );
+            frame_in_flight = true;
+        }
+
+        // copy the rendered image to the screen, scaling it up if it was rendered at a lower resolution
+        // the pixels are converted in bulk, straight into the memory of the draw target (which the engine then uploads)
+        RT_ZONE( "Draw" );
+        static_assert( sizeof( olc::Pixel ) == sizeof( uint32_t ), "olc::Pixel is expected to be a packed RGBA value" );
+        uint32_t *screen = reinterpret_cast<uint32_t *>( GetDrawTarget()->GetData());
+        const Framebuffer &image = PIPELINE_FRAMES ? presented : renderer.Image();
+        if (image.width == ScreenWidth() && image.height == ScreenHeight()) {
+            image.ToRGBA8( screen );
+        } else {
+            Upscale( image, upscaled );
+            upscaled.ToRGBA8( screen );
+        }
+
+        if (FRAME_BUDGET_CONTROL && show_readout) {
+            const RenderSettings &settings = renderer.Settings();
+            char readout[128];
+            snprintf( readout, sizeof( readout ), "%dx%d (%d%%) %d spp %d bounces  %.1f / %.1f ms",
+                      settings.width, settings.height, int( controller.Scale() * 100.0f + 0.5f ), settings.samples,
+                      settings.bounces, controller.AverageTime() * 1000.0f, FRAME_TIME_BUDGET * 1000.0f );
+            DrawString( 4, 4, readout, olc::WHITE );
+        }
+		return true;
+    }
+
+    // apply the keys that were pressed and the frame time budget to the settings of the renderer
+    void UpdateSettings( float fElapsedTime ) {
+        // the number keys select a quality preset, I toggles the readout
+        for (int i = 0; i < QUALITY_PRESET_COUNT && i < 9; i++) {
+            if (GetKey( olc::Key( olc::Key::K1 + i )).bPressed) {
+                RenderSettings settings = controller.Base();
+                settings.ApplyPreset( QUALITY_PRESETS[i] );
+                controller.Reset( settings );
+                renderer.Configure( controller.Settings());
+            }
+        }
+        if (GetKey( olc::Key::I ).bPressed)
+            show_readout = !show_readout;
+
+        // adapt the quality to the time the previous frames took
+        if (FRAME_BUDGET_CONTROL && controller.Update( fElapsedTime ))
+            renderer.Configure( controller.Settings());
+    }
+
+    // move the scene along by elapsed_time seconds and trace it
+    void TraceFrame( float elapsed_time ) {
+        renderer.Animate( elapsed_time );
+        renderer.RenderFrame();
+#ifdef RT_INSTRUMENT
+        total_hot_counters += renderer.FrameHotPathCounters();
+#endif
+    }
+
+    // scale an image that is smaller than the screen up to the size of the screen
+    void Upscale( const Framebuffer &image, Framebuffer &scaled ) const {
+        if (scaled.width != ScreenWidth() || scaled.height != ScreenHeight())
+            scaled.Resize( ScreenWidth(), ScreenHeight());
+        float scale_x = float( image.width  ) / ScreenWidth();
+        float scale_y = float( image.height ) / ScreenHeight();
+        for (int y = 0; y < ScreenHeight(); y++) {
+            for (int x = 0; x < ScreenWidth(); x++) {
+                color3 color;
+                if (UPSCALE_FILTER == UpscaleFilter::NEAREST) {
+                    color = image.at( std::min( int( x * scale_x ), image.width  - 1 ),
+                                      std::min( int( y * scale_y ), image.height - 1 ));
+                } else {
+                    // the image pixel centers are at (i + 0.5) / scale, interpolate between the four nearest ones
+                    float fx = std::clamp( (x + 0.5f) * scale_x - 0.5f, 0.0f, float( image.width  - 1 ));
+                    float fy = std::clamp( (y + 0.5f) * scale_y - 0.5f, 0.0f, float( image.height - 1 ));
+                    int x0 = int( fx ), x1 = std::min( x0 + 1, image.width  - 1 );
+                    int y0 = int( fy ), y1 = std::min( y0 + 1, image.height - 1 );
+                    float tx = fx - x0, ty = fy - y0;
+                    color3 top    = image.at( x0, y0 ) * (1.0f - tx) + image.at( x1, y0 ) * tx;
+                    color3 bottom = image.at( x0, y1 ) * (1.0f - tx) + image.at( x1, y1 ) * tx;
+                    color = top * (1.0f - ty) + bottom * ty;
+                }
+                scaled.at( x, y ) = color;
+            }
+        }
+    }
+
+private:
+    Renderer            renderer;
+    FrameTimeController controller;
+    std::string         scene_file;
+    bool                show_readout = true;
+#ifdef RT_INSTRUMENT
+    HotPathCounters     total_hot_counters;
+#endif
+    // the last frame that was traced completely, and whether the next one is being traced (see PIPELINE_FRAMES)
+    // (the pipeline is declared last, so its thread is stopped before the renderer it uses is destroyed)
+    Framebuffer         presented;
+    bool                frame_in_flight = false;
+    // the image scaled up to the screen, when it's rendered at a lower resolution
+    Framebuffer         upscaled;
+    FramePipeline       pipeline;
+
+    bool OnUserDestroy() override {
+        // your clean up code here
+        pipeline.Wait();
+#ifdef RT_INSTRUMENT
+        fprintf( stderr, "hot path counters: " );
+        total_hot_counters.Print( stderr );
+        fprintf( stderr, "\n" );
+#endif
+#ifdef RT_TRACE
+        if (!TraceRecorder::Write( TRACE_FILE ))
+            fprintf( stderr, "can't write %s\n", TRACE_FILE );
+#endif
+        return true;
+    }
+};
+
+
+#endif // RT_HEADLESS
+
+// the settings can be given as "--name value" pairs on the command line (see RenderSettings::Set()),
+// and "--config FILE" reads them from a file
+bool ParseSettings( int argc, char *argv[], RenderSettings &settings, std::vector<std::pair<std::string, std::string>> *other_options = nullptr )
+{
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (option.compare( 0, 2, "--" ) != 0 || i + 1 >= argc)
+            return false;
+        std::string name  = option.substr( 2 );
+        std::string value = argv[++i];
+        if (name == "config") {
+            if (!settings.Load( value )) {
+                fprintf( stderr, "can't read config file %s\n", value.c_str() );
+                return false;
+            }
+        } else if (!settings.Set( name, value )) {
+            if (other_options == nullptr)
+                return false;
+            other_options->emplace_back( name, value );
+        }
+    }
+    return true;
+}
+
+#ifndef RT_HEADLESS
+
+int main( int argc, char *argv[] )
+{
+    RenderSettings settings;
+    std::vector<std::pair<std::string, std::string>> options;
+    bool valid = ParseSettings( argc, argv, settings, &options );
+    std::string scene_file;
+    for (const auto &[name, value] : options) {
+        if (name == "scene-file")
+            scene_file = value;
+        else
+            valid = false;
+    }
+    if (!valid) {
+        fprintf( stderr, "usage: %s [--config FILE] [--preset NAME] [--width W] [--height H] [--samples S] [--bounces B] [--fog D] [--ambient A] [--denoise 0|1]"
+                         " [--gpu 0|1] [--scene-file FILE]\n", argv[0] );
+        return 1;
+    }
+
+	RayTracer demo( settings, scene_file );
+	if (demo.Construct( settings.width, settings.height, PIXEL_X, PIXEL_Y ))
+		demo.Start();
+
+	return 0;
+}
+
+#else // RT_HEADLESS
+
+// the measurements of a benchmark run over one scene
+struct BenchmarkResult {
+    Scene               scene;
+    size_t              shape_count;
+    double              build_ms;
+    std::vector<double> frame_ms;           // per frame: animation (including the BVH refit) + render
+    double              animate_ms = 0.0;   // total over all frames
+    double              render_ms  = 0.0;   // total over all frames
+    RayCounts           rays;               // total over all frames
+#ifdef RT_INSTRUMENT
+    HotPathCounters     hot;                // total over all frames
+#endif
+    // with the GPU backend: the mean absolute and the mean signed difference of the color channels of the last frame,
+    // from that frame rendered on the CPU
+    bool                gpu            = false;
+    double              gpu_difference = 0.0;
+    double              gpu_bias       = 0.0;
+    bool                gpu_matches    = false; // both are within their tolerances (see GPU_TOLERANCE)
+
+    // the p-th percentile of the frame times (nearest rank)
+    double Percentile( double p ) const {
+        std::vector<double> sorted = frame_ms;
+        std::sort( sorted.begin(), sorted.end());
+        size_t rank = size_t( std::ceil( p / 100.0 * sorted.size()));
+        return sorted[std::clamp<size_t>( rank, 1, sorted.size()) - 1];
+    }
+    double Mean() const {
+        return std::accumulate( frame_ms.begin(), frame_ms.end(), 0.0 ) / frame_ms.size();
+    }
+    double RaysPerSecond() const {
+        return rays.Total() / (std::accumulate( frame_ms.begin(), frame_ms.end(), 0.0 ) / 1000.0);
+    }
+};
+
+// the largest mean signed difference of a color channel between the GPU backend and the CPU, for which they match - the
+// absolute differences are mostly noise (the two sample their pixels differently), the signed ones average out. The
+// mean absolute difference has to stay within GPU_NOISE_TOLERANCE at one sample per pixel, and within that divided by
+// the square root of the samples at more (like the noise), which catches errors that cancel out on average.
+constexpr double GPU_TOLERANCE       = 0.002;
+constexpr double GPU_NOISE_TOLERANCE = 0.04;
+
+// render frames frames of a scene, animating it by 1/30th of a second per frame so that every run is the same
+BenchmarkResult RunBenchmark( Renderer &renderer, Scene scene, int frames )
+{
+    using clock = std::chrono::steady_clock;
+    auto milliseconds = []( clock::time_point from, clock::time_point to ) {
+        return std::chrono::duration<double, std::milli>( to - from ).count();
+    };
+
+    BenchmarkResult result;
+    result.scene = scene;
+    clock::time_point build_start = clock::now();
+    renderer.CreateScene( scene );
+    result.build_ms    = milliseconds( build_start, clock::now());
+    result.shape_count = renderer.Shapes().size();
+
+    for (int frame = 0; frame < frames; frame++) {
+        clock::time_point frame_start = clock::now();
+        renderer.SetTime( float( frame + 1 ) / 30.0f );
+        clock::time_point render_start = clock::now();
+        renderer.RenderFrame();
+        clock::time_point frame_end = clock::now();
+
+        result.animate_ms += milliseconds( frame_start,  render_start );
+        result.render_ms  += milliseconds( render_start, frame_end );
+        result.frame_ms.push_back( milliseconds( frame_start, frame_end ));
+        result.rays += renderer.FrameRayCounts();
+#ifdef RT_INSTRUMENT
+        result.hot += renderer.FrameHotPathCounters();
+#endif
+    }
+
+    // render the last frame on the CPU as well, to compare the GPU backend to
+    if (renderer.RendersOnGpu()) {
+        Framebuffer    gpu_image = renderer.Image();
+        RenderSettings settings  = renderer.Settings();
+        settings.gpu = false;
+        renderer.Configure( settings );
+        renderer.RenderFrame();
+        const std::vector<color3> &cpu_pixels = renderer.Image().pixels;
+        for (size_t i = 0; i < cpu_pixels.size(); i++) {
+            color3 d = gpu_image.pixels[i] - cpu_pixels[i];
+            result.gpu_difference += fabs( d.x ) + fabs( d.y ) + fabs( d.z );
+            result.gpu_bias       += d.x + d.y + d.z;
+        }
+        result.gpu             = true;
+        result.gpu_difference /= 3.0 * cpu_pixels.size();
+        result.gpu_bias       /= 3.0 * cpu_pixels.size();
+        result.gpu_matches     = fabs( result.gpu_bias ) <= GPU_TOLERANCE &&
+                                 result.gpu_difference <= GPU_NOISE_TOLERANCE / std::sqrt( double( settings.samples ));
+        settings.gpu = true;
+        renderer.Configure( settings );
+    }
+    return result;
+}
+
+// write the results as CSV (if path ends in .csv) or JSON, to stdout if path is empty - returns false on failure
+bool WriteBenchmarkReport( const std::string &path, const Renderer &renderer, const std::vector<BenchmarkResult> &results )
+{
+    bool  csv  = path.size() >= 4 && path.compare( path.size() - 4, 4, ".csv" ) == 0;
+    FILE *file = path.empty() ? stdout : fopen( path.c_str(), "w" );
+    if (file == nullptr)
+        return false;
+
+    const RenderSettings &settings = renderer.Settings();
+    if (csv) {
+        fprintf( file, "scene,shapes,width,height,samples,bounces,threads,frames,build_ms,frame_ms_mean,frame_ms_p50,frame_ms_p90,"
+                       "frame_ms_p99,frame_ms_max,animate_ms_mean,render_ms_mean,primary_rays,shadow_rays,reflection_rays,rays_per_second\n" );
+        for (const BenchmarkResult &r : results) {
+            size_t frames = r.frame_ms.size();
+            fprintf( file, "%s,%zu,%d,%d,%d,%d,%d,%zu,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%llu,%llu,%llu,%.0f\n",
+                     SCENE_NAMES[int( r.scene )], r.shape_count, settings.width, settings.height, settings.samples, settings.bounces,
+                     renderer.ThreadCount(), frames, r.build_ms, r.Mean(), r.Percentile( 50 ), r.Percentile( 90 ), r.Percentile( 99 ),
+                     r.Percentile( 100 ), r.animate_ms / frames, r.render_ms / frames, (unsigned long long)r.rays.primary,
+                     (unsigned long long)r.rays.shadow, (unsigned long long)r.rays.reflection, r.RaysPerSecond());
+        }
+    } else {
+        fprintf( file, "{\n  \"settings\": { \"width\": %d, \"height\": %d, \"samples\": %d, \"bounces\": %d, \"threads\": %d, \"gpu\": %d },\n  \"scenes\": [\n",
+                 settings.width, settings.height, settings.samples, settings.bounces, renderer.ThreadCount(), int( settings.gpu ));
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchmarkResult &r = results[i];
+            size_t frames = r.frame_ms.size();
+            fprintf( file, "    {\n      \"scene\": \"%s\", \"shapes\": %zu, \"frames\": %zu, \"build_ms\": %.3f,\n",
+                     SCENE_NAMES[int( r.scene )], r.shape_count, frames, r.build_ms );
+            fprintf( file, "      \"frame_ms\": { \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+                     r.Mean(), r.Percentile( 50 ), r.Percentile( 90 ), r.Percentile( 99 ), r.Percentile( 100 ));
+            fprintf( file, "      \"animate_ms_mean\": %.3f, \"render_ms_mean\": %.3f,\n", r.animate_ms / frames, r.render_ms / frames );
+            fprintf( file, "      \"rays\": { \"primary\": %llu, \"shadow\": %llu, \"reflection\": %llu, \"total\": %llu },\n",
+                     (unsigned long long)r.rays.primary, (unsigned long long)r.rays.shadow, (unsigned long long)r.rays.reflection,
+                     (unsigned long long)r.rays.Total());
+            if (r.gpu) {
+                fprintf( file, "      \"gpu\": { \"mean_difference\": %.5f, \"bias\": %.5f, \"within_tolerance\": %s },\n",
+                         r.gpu_difference, r.gpu_bias, r.gpu_matches ? "true" : "false" );
+            }
+#ifdef RT_INSTRUMENT
+            fprintf( file, "      \"counters\": " );
+            r.hot.Print( file );
+            fprintf( file, ",\n" );
+#endif
+            fprintf( file, "      \"rays_per_second\": %.0f\n    }%s\n", r.RaysPerSecond(), i + 1 < results.size() ? "," : "" );
+        }
+        fprintf( file, "  ]\n}\n" );
+    }
+    return file == stdout ? fflush( file ) == 0 : fclose( file ) == 0;
+}
+
+// how far the RT_FAST_MATH helpers may be from the exact ones: the largest difference of a component of a normalized
+// vector, and the largest distance (relative to the coordinate) from the edge of a checker at which the checkerboard
+// may differ
+constexpr float FAST_MATH_NORMALIZE_TOLERANCE = 1e-6f;
+constexpr float FAST_MATH_CHECKER_TOLERANCE   = 1e-6f;
+
+// compare the RT_FAST_MATH helpers with the exact ones on count random inputs (of which the magnitudes span from 1e-3
+// to 1e5, and half of those of the checkerboard are right next to the edge of a checker), and report the largest
+// errors - returns false if they are beyond the tolerances
+bool ValidateFastMath( int count ) {
+    pcg32 rng( 29 );
+    auto random_value = [&rng]() {
+        float magnitude = powf( 10.0f, rng.next_float() * 8.0f - 3.0f );
+        return rng.next_float() < 0.5f ? -magnitude : magnitude;
+    };
+    float normalize_error = 0.0f, checker_error = 0.0f;
+    int   checker_differences = 0;
+    for (int i = 0; i < count; i++) {
+        vf3d v( random_value(), random_value(), random_value());
+        vf3d exact = v / v.length();
+        vf3d fast  = v * FastRsqrt( v * v );
+        normalize_error = std::max( { normalize_error, fabsf( fast.x - exact.x ), fabsf( fast.y - exact.y ), fabsf( fast.z - exact.z ) } );
+
+        float d = random_value();
+        if (i % 2 == 1)
+            d = nextafterf( 50.0f * roundf( d / 50.0f ), rng.next_float() < 0.5f ? 0.0f : d * 2.0f );
+        if (CheckerSpanFast( d ) != CheckerSpanExact( d )) {
+            checker_differences++;
+            checker_error = std::max( checker_error, fabsf( d - 50.0f * roundf( d / 50.0f )) / fabsf( d ));
+        }
+    }
+    bool valid = normalize_error <= FAST_MATH_NORMALIZE_TOLERANCE && checker_error <= FAST_MATH_CHECKER_TOLERANCE;
+    fprintf( stderr, "fast math over %d inputs: normalize() within %g (tolerance %g), checkerboard differs %d times, "
+                     "at most %g from an edge (tolerance %g) - %s\n", count, normalize_error, FAST_MATH_NORMALIZE_TOLERANCE,
+             checker_differences, checker_error, FAST_MATH_CHECKER_TOLERANCE, valid ? "ok" : "FAILED" );
+    return valid;
+}
+
+#ifndef _WIN32
+
+// distributed rendering: a coordinator (--workers HOST:PORT,...) splits the image in bands of FARM_BAND_TILE_ROWS rows of
+// tiles, and hands those out to worker processes (--worker PORT) on other machines. Each worker gets the scene once (a
+// scene file as it is, or the name of a built-in scene, which also brings its animation), renders all frames of a band,
+// and sends back the pixels of the last frame. Those are received right into the rows of the image; rendering a band
+// doesn't depend on the worker, so every band comes out the same as if rendered locally. A worker that fails, or takes
+// longer than FARM_WORKER_TIMEOUT_MS, is dropped and its band handed out again - and once all bands are handed out, the
+// workers that are idle duplicate the bands that are still being rendered, so a slow worker doesn't hold up the image.
+// The bands that no worker rendered are rendered by the coordinator itself. The workers must be built the same (the
+// messages are in the byte order of the machine), and the image is never denoised (that needs all of it at once) or
+// rendered on the GPU (the GPU backend always renders the whole image).
+constexpr int      FARM_BAND_TILE_ROWS    = 2;
+constexpr int      FARM_WORKER_TIMEOUT_MS = 60000;
+constexpr int      FARM_MAX_COPIES        = 2;                  // times that a band is rendered at the same time at most
+constexpr uint64_t FARM_MAX_SCENE_BYTES   = uint64_t( 1 ) << 30; // size of a scene file that a worker accepts at most
+constexpr char     FARM_MAGIC[8]          = "RTFARM1";
+
+enum class FarmMessage : uint32_t {
+    SCENE,      // coordinator to worker: a FarmScene, followed by the scene file (if it's not a built-in scene)
+    BAND,       // coordinator to worker: render the band
+    PIXELS,     // worker to coordinator: the pixels of the band, row by row
+    DONE        // coordinator to worker: the render is complete
+};
+struct FarmHeader {
+    uint32_t type;              // FarmMessage
+    int32_t  band;
+    uint64_t size;              // bytes that follow the header
+};
+struct FarmScene {
+    char           magic[8];    // FARM_MAGIC
+    RenderSettings settings;
+    int32_t        scene;       // the built-in Scene, or -1 for a scene file
+    int32_t        frames;
+    float          frame_time;
+};
+static_assert( std::is_trivially_copyable_v<FarmScene>, "the scene message is sent as it is" );
+static_assert( sizeof( color3 ) == 3 * sizeof( float ), "the pixels are sent as they are" );
+
+// a TCP connection between the coordinator and a worker, that sends and receives whole buffers
+class FarmSocket {
+public:
+    explicit FarmSocket( int _fd = -1 ) : fd( _fd ) {}
+    ~FarmSocket() { Close(); }
+
+    FarmSocket( FarmSocket &&other ) noexcept : fd( std::exchange( other.fd, -1 )) {}
+    FarmSocket &operator=( FarmSocket &&other ) noexcept {
+        if (this != &other) {
+            Close();
+            fd = std::exchange( other.fd, -1 );
+        }
+        return *this;
+    }
+
+    // connect to address ("host:port"), giving up on a receive after timeout_ms (0 = never)
+    bool Connect( const std::string &address, int timeout_ms ) {
+        Close();
+        size_t colon = address.rfind( ':' );
+        if (colon == std::string::npos)
+            return false;
+        addrinfo hints = addrinfo(), *found = nullptr;
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo( address.substr( 0, colon ).c_str(), address.c_str() + colon + 1, &hints, &found ) != 0)
+            return false;
+        for (addrinfo *a = found; a != nullptr && fd < 0; a = a->ai_next) {
+            fd = socket( a->ai_family, a->ai_socktype, a->ai_protocol );
+            if (fd >= 0 && connect( fd, a->ai_addr, a->ai_addrlen ) != 0)
+                Close();
+        }
+        freeaddrinfo( found );
+        if (fd >= 0 && timeout_ms > 0) {
+            timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+            setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ));
+        }
+        SetNoDelay();
+        return fd >= 0;
+    }
+
+    // wait for a connection on the listening socket
+    bool Accept( int listener ) {
+        Close();
+        fd = accept( listener, nullptr, nullptr );
+        SetNoDelay();
+        return fd >= 0;
+    }
+
+    bool Send( const void *data, size_t size ) {
+        for (const char *p = static_cast<const char *>( data ); fd >= 0 && size > 0; ) {
+            ssize_t sent = send( fd, p, size, 0 );
+            if (sent <= 0)
+                return false;
+            p    += sent;
+            size -= size_t( sent );
+        }
+        return fd >= 0;
+    }
+    bool Receive( void *data, size_t size ) {
+        for (char *p = static_cast<char *>( data ); fd >= 0 && size > 0; ) {
+            ssize_t received = recv( fd, p, size, 0 );
+            if (received <= 0)
+                return false;
+            p    += received;
+            size -= size_t( received );
+        }
+        return fd >= 0;
+    }
+
+    // start a message, of which size bytes follow
+    bool SendHeader( FarmMessage type, int band, size_t size = 0 ) {
+        FarmHeader header = { uint32_t( type ), band, uint64_t( size ) };
+        return Send( &header, sizeof( header ));
+    }
+
+    void Close() {
+        if (fd >= 0)
+            close( fd );
+        fd = -1;
+    }
+
+    int  Fd()     const { return fd; }
+    bool IsOpen() const { return fd >= 0; }
+
+private:
+    int fd = -1;
+
+    void SetNoDelay() {
+        int on = 1;
+        if (fd >= 0)
+            setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ));
+    }
+};
+
+// the pixel rows [y_begin, y_end) of a band
+inline void FarmBandRows( const Renderer &renderer, int band, int &y_begin, int &y_end ) {
+    y_begin = std::min( band * FARM_BAND_TILE_ROWS * TILE_SIZE, renderer.Settings().height );
+    y_end   = std::min( y_begin + FARM_BAND_TILE_ROWS * TILE_SIZE, renderer.Settings().height );
+}
+
+inline int FarmBandCount( const Renderer &renderer ) {
+    return (renderer.TileRows() + FARM_BAND_TILE_ROWS - 1) / FARM_BAND_TILE_ROWS;
+}
+
+// render all frames of a band, from the first one on (the headless renderer without workers renders them the same way)
+inline void RenderFarmBand( Renderer &renderer, int band, int frames, float frame_time ) {
+    renderer.Rewind();
+    renderer.RestrictTileRows( band * FARM_BAND_TILE_ROWS, (band + 1) * FARM_BAND_TILE_ROWS );
+    for (int frame = 0; frame < frames; frame++) {
+        renderer.SetTime( frame_time * float( frame + 1 ));
+        renderer.RenderFrame();
+    }
+    renderer.RestrictTileRows( 0, -1 );
+}
+
+// serve the coordinators that connect on the port, one after the other: load the scene a coordinator sends, and render
+// the bands it asks for - this only returns if the port can't be listened on
+int RunWorker( int port )
+{
+    signal( SIGPIPE, SIG_IGN );    // a coordinator that went away shows up as a failed send instead
+    int listener = socket( AF_INET, SOCK_STREAM, 0 );
+    int on = 1;
+    sockaddr_in address = sockaddr_in();
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl( INADDR_ANY );
+    address.sin_port        = htons( uint16_t( port ));
+    if (listener < 0 || setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof( on )) != 0 ||
+        bind( listener, reinterpret_cast<sockaddr *>( &address ), sizeof( address )) != 0 || listen( listener, 4 ) != 0) {
+        fprintf( stderr, "can't listen on port %d\n", port );
+        return 1;
+    }
+    fprintf( stderr, "worker listening on port %d\n", port );
+
+    Renderer renderer;
+    std::vector<uint8_t> scene_data;
+    FarmSocket coordinator;
+    for (;;) {
+        if (!coordinator.Accept( listener )) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        FarmHeader header;
+        FarmScene  farm;
+        bool ok = coordinator.Receive( &header, sizeof( header )) && header.type == uint32_t( FarmMessage::SCENE ) &&
+                  header.size >= sizeof( farm ) && header.size - sizeof( farm ) <= FARM_MAX_SCENE_BYTES &&
+                  coordinator.Receive( &farm, sizeof( farm )) &&
+                  memcmp( farm.magic, FARM_MAGIC, sizeof( farm.magic )) == 0 && farm.frames > 0 && farm.scene < SCENE_COUNT &&
+                  farm.settings.width > 0 && farm.settings.height > 0 && farm.settings.samples > 0 && farm.settings.bounces > 0 &&
+                  !farm.settings.denoise && !farm.settings.gpu;
+        if (ok) {
+            scene_data.resize( header.size - sizeof( farm ));
+            ok = coordinator.Receive( scene_data.data(), scene_data.size());
+        }
+        if (ok) {
+            renderer.Configure( farm.settings );
+            if (farm.scene >= 0)
+                renderer.CreateScene( Scene( farm.scene ));
+            else
+                ok = renderer.LoadScene( scene_data.data(), scene_data.size());
+        }
+        if (ok)
+            fprintf( stderr, "rendering %zu shapes at %dx%d\n", renderer.Shapes().size(), farm.settings.width, farm.settings.height );
+        else
+            fprintf( stderr, "can't receive the scene of a coordinator\n" );
+        // the pixels of the image are sent right from its rows
+        while (ok && coordinator.Receive( &header, sizeof( header )) && header.type == uint32_t( FarmMessage::BAND ) &&
+               header.band >= 0 && header.band < FarmBandCount( renderer )) {
+            int y_begin, y_end;
+            FarmBandRows( renderer, header.band, y_begin, y_end );
+            RenderFarmBand( renderer, header.band, farm.frames, farm.frame_time );
+            const color3 *rows = renderer.Image().pixels.data() + size_t( y_begin ) * farm.settings.width;
+            size_t size = size_t( y_end - y_begin ) * farm.settings.width * sizeof( color3 );
+            ok = coordinator.SendHeader( FarmMessage::PIXELS, header.band, size ) && coordinator.Send( rows, size );
+        }
+        coordinator.Close();
+    }
+    close( listener );
+    fprintf( stderr, "can't accept connections on port %d\n", port );
+    return 1;
+}
+
+// render the frames of the scene of the renderer on the workers (a comma separated list of "host:port"), into image
+// scene is the built-in Scene of the renderer, or -1 if it was loaded from scene_file
+bool RunCoordinator( Renderer &renderer, const std::string &workers, int scene, const std::string &scene_file, int frames, float frame_time,
+                     Framebuffer &image )
+{
+    using clock = std::chrono::steady_clock;
+    signal( SIGPIPE, SIG_IGN );
+    const RenderSettings &settings = renderer.Settings();
+    image.Resize( settings.width, settings.height );
+
+    // the scene file is sent from where it's mapped
+    MappedFile scene_data;
+    if (scene < 0 && !scene_data.Open( scene_file )) {
+        fprintf( stderr, "can't read scene file %s\n", scene_file.c_str() );
+        return false;
+    }
+    if (scene_data.Size() > FARM_MAX_SCENE_BYTES) {
+        fprintf( stderr, "scene file %s is too large to send to the workers\n", scene_file.c_str() );
+        return false;
+    }
+    FarmScene farm = FarmScene();
+    memcpy( farm.magic, FARM_MAGIC, sizeof( farm.magic ));
+    farm.settings   = settings;
+    farm.scene      = scene;
+    farm.frames     = frames;
+    farm.frame_time = frame_time;
+
+    struct farm_worker {
+        std::string       address;
+        FarmSocket        socket;
+        int               band = -1;    // -1 while idle
+        clock::time_point started;
+    };
+    std::vector<farm_worker> pool;
+    for (size_t start = 0; start < workers.size(); ) {
+        size_t comma = std::min( workers.find( ',', start ), workers.size());
+        farm_worker worker;
+        worker.address = workers.substr( start, comma - start );
+        start = comma + 1;
+        if (worker.socket.Connect( worker.address, FARM_WORKER_TIMEOUT_MS ) &&
+            worker.socket.SendHeader( FarmMessage::SCENE, -1, sizeof( farm ) + scene_data.Size()) &&
+            worker.socket.Send( &farm, sizeof( farm )) && worker.socket.Send( scene_data.Data(), scene_data.Size()))
+            pool.push_back( std::move( worker ));
+        else
+            fprintf( stderr, "can't reach worker %s\n", worker.address.c_str() );
+    }
+
+    int band_count = FarmBandCount( renderer ), remaining = band_count;
+    std::vector<bool> band_done( band_count, false );
+    std::vector<int>  band_copies( band_count, 0 );     // the workers that are rendering it
+    std::vector<pollfd> waiting;
+    std::vector<color3> discarded;                       // the pixels of a band that another worker rendered first
+    auto drop = [&]( farm_worker &worker, const char *reason ) {
+        fprintf( stderr, "dropping worker %s: %s\n", worker.address.c_str(), reason );
+        if (worker.band >= 0)
+            band_copies[worker.band]--;
+        worker.socket.Close();
+        worker.band = -1;
+    };
+    while (remaining > 0) {
+        // give each idle worker the first band that nobody renders yet, or else the one that the fewest workers render
+        for (farm_worker &worker : pool) {
+            if (!worker.socket.IsOpen() || worker.band >= 0)
+                continue;
+            int best = -1;
+            for (int band = 0; band < band_count; band++)
+                if (!band_done[band] && band_copies[band] < FARM_MAX_COPIES && (best < 0 || band_copies[band] < band_copies[best]))
+                    best = band;
+            if (best < 0)
+                break;
+            if (!worker.socket.SendHeader( FarmMessage::BAND, best )) {
+                drop( worker, "send failed" );
+                continue;
+            }
+            worker.band    = best;
+            worker.started = clock::now();
+            band_copies[best]++;
+        }
+
+        waiting.clear();
+        for (farm_worker &worker : pool)
+            if (worker.band >= 0)
+                waiting.push_back( { worker.socket.Fd(), POLLIN, 0 } );
+        if (waiting.empty())
+            break;
+        if (poll( waiting.data(), nfds_t( waiting.size()), 100 ) < 0 && errno != EINTR)
+            break;
+
+        for (farm_worker &worker : pool) {
+            if (worker.band < 0)
+                continue;
+            auto it = std::find_if( waiting.begin(), waiting.end(), [&worker]( const pollfd &p ) { return p.fd == worker.socket.Fd(); } );
+            if (it->revents == 0) {
+                if (clock::now() - worker.started > std::chrono::milliseconds( FARM_WORKER_TIMEOUT_MS ))
+                    drop( worker, "timed out" );
+                continue;
+            }
+            int y_begin, y_end;
+            FarmBandRows( renderer, worker.band, y_begin, y_end );
+            size_t pixel_count = size_t( y_end - y_begin ) * settings.width;
+            FarmHeader header;
+            if (!worker.socket.Receive( &header, sizeof( header ))) {
+                drop( worker, "connection lost" );
+                continue;
+            }
+            if (header.type != uint32_t( FarmMessage::PIXELS ) || header.band != worker.band || header.size != pixel_count * sizeof( color3 )) {
+                drop( worker, "bad reply" );
+                continue;
+            }
+            // the pixels go right into the image, unless another worker was first
+            color3 *target = image.pixels.data() + size_t( y_begin ) * settings.width;
+            if (band_done[worker.band]) {
+                discarded.resize( pixel_count );
+                target = discarded.data();
+            }
+            if (!worker.socket.Receive( target, header.size )) {
+                drop( worker, "receive failed" );
+                continue;
+            }
+            if (!band_done[worker.band]) {
+                band_done[worker.band] = true;
+                remaining--;
+            }
+            band_copies[worker.band]--;
+            worker.band = -1;
+        }
+    }
+    for (farm_worker &worker : pool)
+        if (worker.socket.IsOpen() && worker.band < 0)
+            worker.socket.SendHeader( FarmMessage::DONE, -1 );
+
+    if (remaining > 0)
+        fprintf( stderr, "rendering %d of %d bands locally\n", remaining, band_count );
+    for (int band = 0; band < band_count; band++) {
+        if (band_done[band])
+            continue;
+        int y_begin, y_end;
+        FarmBandRows( renderer, band, y_begin, y_end );
+        RenderFarmBand( renderer, band, frames, frame_time );
+        std::copy( renderer.Image().pixels.begin() + size_t( y_begin ) * settings.width,
+                   renderer.Image().pixels.begin() + size_t( y_end ) * settings.width, image.pixels.begin() + size_t( y_begin ) * settings.width );
+    }
+    return true;
+}
+
+#endif // _WIN32
+
+// the command line renderer: renders a number of frames of the scene, and writes the last one to an image file
+// besides the settings (see ParseSettings()) it takes
+//   --scene NAME       the scene to render (default step6, see SCENE_NAMES)
+//   --frames F         number of frames to render (default 1) - while the scene doesn't move they accumulate
+//   --time T           seconds that the animation advances per frame (default 0)
+//   --output FILE      the image to write, .ppm, .png or .pfm (default render.png)
+// or with --benchmark it renders F frames of every scene (or only the one given with --scene), and reports the timings
+//   --benchmark F      number of frames per scene
+//   --report FILE      where to write the report, .json or .csv (default: JSON to stdout)
+// or it renders on other machines (see RunCoordinator()), or is one of those machines (see RunWorker())
+//   --workers LIST     the workers to render on, as HOST:PORT,HOST:PORT,...
+//   --worker PORT      serve as a worker on the port
+// or it checks the RT_FAST_MATH helpers against the exact ones (see ValidateFastMath())
+//   --check-math N     number of random inputs to check
+// when built with RT_TRACE, the trace zones are written to --trace FILE (default raytracer_trace.json)
+int main( int argc, char *argv[] )
+{
+    RenderSettings settings;
+    int            frames           = 1;
+    int            benchmark_frames = 0;
+    float          frame_time       = 0.0f;
+    int            scene            = -1;
+    std::string    output           = "render.png";
+    std::string    report;
+    std::string    trace            = "raytracer_trace.json";
+    std::string    scene_file, save_scene, convert;
+    std::string    workers;
+    int            worker_port      = 0;
+    int            check_math       = 0;
+
+    auto usage = [&argv]() {
+        fprintf( stderr, "usage: %s [--config FILE] [--preset NAME] [--width W] [--height H] [--samples S] [--bounces B] [--fog D] [--ambient A] [--denoise 0|1]"
+                         " [--gpu 0|1] [--scene NAME] [--scene-file FILE] [--save-scene FILE] [--frames F] [--time T] [--output FILE] [--benchmark F]"
+                         " [--report FILE] [--trace FILE] [--workers HOST:PORT,...]\n"
+                         "       %s --convert TEXT_FILE --output SCENE_FILE\n"
+                         "       %s --worker PORT\n"
+                         "       %s --check-math N\n", argv[0], argv[0], argv[0], argv[0] );
+        return 1;
+    };
+    std::vector<std::pair<std::string, std::string>> options;
+    if (!ParseSettings( argc, argv, settings, &options ))
+        return usage();
+    for (const auto &[name, value] : options) {
+        if      (name == "frames"   ) frames           = atoi( value.c_str());
+        else if (name == "time"     ) frame_time       = float( atof( value.c_str()));
+        else if (name == "output"   ) output           = value;
+        else if (name == "benchmark") benchmark_frames = atoi( value.c_str());
+        else if (name == "report"   ) report           = value;
+        else if (name == "trace"    ) trace            = value;
+        else if (name == "scene-file") scene_file      = value;
+        else if (name == "save-scene") save_scene      = value;
+        else if (name == "convert"  ) convert          = value;
+        else if (name == "workers"  ) workers          = value;
+        else if (name == "worker"   ) worker_port      = atoi( value.c_str());
+        else if (name == "check-math") check_math      = atoi( value.c_str());
+        else if (name == "scene"    ) scene            = int( std::find( SCENE_NAMES, SCENE_NAMES + SCENE_COUNT, value ) - SCENE_NAMES );
+        else
+            return usage();
+    }
+    if (frames <= 0 || benchmark_frames < 0 || scene >= SCENE_COUNT || worker_port < 0 || worker_port > 65535 || check_math < 0)
+        return usage();
+
+    if (check_math > 0)
+        return ValidateFastMath( check_math ) ? 0 : 1;
+
+    // converting a scene from the text format doesn't render anything
+    if (!convert.empty())
+        return ConvertScene( convert, output ) ? 0 : 1;
+
+#ifdef _WIN32
+    if (worker_port > 0 || !workers.empty()) {
+        fprintf( stderr, "distributed rendering is only available with POSIX sockets\n" );
+        return 1;
+    }
+#else
+    // a worker gets its settings and scene from the coordinator
+    if (worker_port > 0)
+        return RunWorker( worker_port );
+    if (!workers.empty() && (settings.denoise || settings.gpu || benchmark_frames > 0)) {
+        fprintf( stderr, "a distributed render can't be denoised, benchmarked or rendered on the GPU\n" );
+        return 1;
+    }
+#endif
+
+    Renderer renderer( settings );
+
+    if (benchmark_frames > 0) {
+        std::vector<BenchmarkResult> results;
+        for (int i = 0; i < SCENE_COUNT; i++) {
+            if (scene < 0 || scene == i) {
+                fprintf( stderr, "benchmarking %s\n", SCENE_NAMES[i] );
+                results.push_back( RunBenchmark( renderer, Scene( i ), benchmark_frames ));
+            }
+        }
+        if (!WriteBenchmarkReport( report, renderer, results )) {
+            fprintf( stderr, "can't write %s\n", report.c_str() );
+            return 1;
+        }
+    } else {
+        if (scene_file.empty()) {
+            renderer.CreateScene( scene < 0 ? Scene::STEP6 : Scene( scene ));
+        } else {
+            auto start = std::chrono::steady_clock::now();
+            if (!renderer.LoadScene( scene_file )) {
+                fprintf( stderr, "can't load scene file %s\n", scene_file.c_str() );
+                return 1;
+            }
+            fprintf( stderr, "loaded %zu shapes from %s in %.1f ms\n", renderer.Shapes().size(), scene_file.c_str(),
+                     std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count());
+        }
+        if (!save_scene.empty() && !renderer.SaveScene( save_scene )) {
+            fprintf( stderr, "can't write %s\n", save_scene.c_str() );
+            return 1;
+        }
+#ifndef _WIN32
+        if (!workers.empty()) {
+            Framebuffer image;
+            int farm_scene = !scene_file.empty() ? -1 : scene < 0 ? int( Scene::STEP6 ) : scene;
+            if (!RunCoordinator( renderer, workers, farm_scene, scene_file, frames, frame_time, image ))
+                return 1;
+            if (!image.Write( output )) {
+                fprintf( stderr, "can't write %s\n", output.c_str() );
+                return 1;
+            }
+            return 0;
+        }
+#endif
+#ifdef RT_INSTRUMENT
+        HotPathCounters total_hot_counters;
+#endif
+        for (int frame = 0; frame < frames; frame++) {
+            // the time of each frame is computed, not summed, so a frame doesn't depend on how many came before it
+            renderer.SetTime( frame_time * float( frame + 1 ));
+            renderer.RenderFrame();
+#ifdef RT_INSTRUMENT
+            total_hot_counters += renderer.FrameHotPathCounters();
+#endif
+        }
+#ifdef RT_INSTRUMENT
+        fprintf( stderr, "hot path counters: " );
+        total_hot_counters.Print( stderr );
+        fprintf( stderr, "\n" );
+#endif
+
+        if (!renderer.Image().Write( output )) {
+            fprintf( stderr, "can't write %s\n", output.c_str() );
+            return 1;
+        }
+    }
+
+#ifdef RT_TRACE
+    if (!TraceRecorder::Write( trace )) {
+        fprintf( stderr, "can't write %s\n", trace.c_str() );
+        return 1;
+    }
+#endif
+    return 0;
 }
 
+#endif // RT_HEADLESS